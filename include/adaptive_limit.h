@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+struct AimdConfig {
+    int32_t initial_limit;  /// the capacity of the semaphore, not above
+    int32_t min_limit = 1;
+    int32_t max_limit;
+    int64_t target_hold_ns; /// mean hold time still considered healthy
+    int32_t additive_step = 1;
+    double backoff        = 0.5; /// multiplicative decrease factor
+    int32_t window        = 32;  /// hold samples per adjustment
+};
+
+/// @note: additive increase / multiplicative decrease of one semaphore's
+/// capacity, driven by how long permits are held. Every `window` releases
+/// the mean hold time is compared against the target, the limit grows by
+/// `additive_step` while it is healthy and is multiplied by `backoff`
+/// when it is not.
+///
+/// @note: the state lives in shared memory, every forked process feeds
+/// the same controller
+class AdaptiveLimit {
+  private:
+    SemaphoreSet &sem_set;
+    sem_nameid_t sem_numid;
+    AimdConfig config;
+
+    struct State {
+        std::atomic< int32_t > limit;
+        std::atomic< int64_t > sum_hold_ns;
+        std::atomic< int32_t > samples;
+        std::atomic_flag adjusting;
+    };
+
+    State *state = nullptr;
+
+    void record(int64_t hold_ns);
+    /// @note: false if another process is adjusting right now
+    bool adjust(int64_t mean_hold_ns);
+
+  public:
+    AdaptiveLimit(
+      SemaphoreSet &sem_set, sem_nameid_t sem_numid, AimdConfig config);
+
+    /// @note: Swait one permit, returns the time it was acquired at.
+    /// The wait is charged to the caller of acquire()
+    int64_t acquire(CallSite site = {});
+
+    /// Ssignal the permit and feed its hold time to the controller
+    void release(int64_t acquired_ns);
+
+    int32_t getLimit() const;
+    ~AdaptiveLimit();
+};
+
+} // namespace lap
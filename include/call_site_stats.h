@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#if __cplusplus >= 202002L
+#include <source_location>
+#endif
+
+namespace lap {
+
+/// call sites counted apart per process, a power of two
+constexpr uint32_t kMaxCallSites = 256;
+
+/// where a Swait was called from, filled in by the default argument
+struct CallSite {
+    const char *file;
+    uint32_t line;
+    const char *function;
+
+#if __cplusplus >= 202002L
+    CallSite(std::source_location loc = std::source_location::current())
+        : file(loc.file_name()), line(loc.line()),
+          function(loc.function_name()) {}
+#else
+    CallSite(const char *file = __builtin_FILE(),
+      uint32_t line = __builtin_LINE(),
+      const char *function = __builtin_FUNCTION())
+        : file(file), line(line), function(function) {}
+#endif
+};
+
+/// @note: counters of one call site, updated with relaxed atomics. Times
+/// are in ns, a hold runs from the acquisition to the matching Ssignal
+struct CallSiteStats {
+    std::atomic< uint32_t > state; /// 0 free, 1 being claimed, 2 in use
+    const char *file;
+    uint32_t line;
+    const char *function;
+
+    std::atomic< uint64_t > waits;
+    std::atomic< uint64_t > parks;
+    std::atomic< uint64_t > wait_ns;
+    std::atomic< uint64_t > max_wait_ns;
+    std::atomic< uint64_t > holds;
+    std::atomic< uint64_t > hold_ns;
+    std::atomic< uint64_t > max_hold_ns;
+
+    void record_wait(int64_t ns);
+    void record_hold(int64_t ns);
+};
+
+/// plain copy of the counters of one call site
+struct CallSiteReport {
+    const char *file;
+    uint32_t line;
+    const char *function;
+    uint64_t waits;
+    uint64_t parks;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t holds;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+};
+
+/// @note: the counters of `site` in the table of this process, shared by
+/// every SemaphoreSet in it. The strings of a CallSite are literals, so
+/// the lookup only compares pointers. Once the table is full new sites
+/// are counted together under "<other>"
+CallSiteStats *call_site_stats(const CallSite &site);
+
+/// position of `stats` in the table, kMaxCallSites for "<other>"
+uint32_t call_site_index(const CallSiteStats *stats);
+
+/// every site seen by this process, most total wait time first
+std::vector< CallSiteReport > call_site_report();
+
+void reset_call_site_stats();
+
+/// @note: one line per call site, as a table readable by people
+void write_call_site_report(std::FILE *fp);
+bool dump_call_sites(const char *path);
+
+} // namespace lap
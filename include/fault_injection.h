@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+namespace lap {
+
+/// places inside Swait and Ssignal that call the fault hook
+enum FaultPoint : uint8_t {
+    FAULT_WAIT_BLOCKED = 0, /// in the waiter table, not parked yet
+    FAULT_WAIT_WOKEN,       /// woken up, hand-off permits not taken yet
+    FAULT_WAIT_ACQUIRED,    /// the semop went through, bookkeeping not
+    FAULT_SIGNAL,           /// holder slot cleared, permits not given back
+    FAULT_LOCKED,           /// holding the control block lock
+    FAULT_WAIT_SHORT,       /// legacy, the semop failed, not published yet
+    FAULT_SIGNAL_RELEASED,  /// legacy, permits back, nobody woken yet
+    kNumFaultPoints,
+};
+
+const char *fault_point_name(FaultPoint point);
+
+/// @note: `sem_numid` is the semaphore the call is about, a hook may
+/// sleep, kill the process or simply return
+using fault_hook_t = void (*)(FaultPoint point, uint16_t sem_numid);
+
+/// the hook of this process, a forked child inherits it
+inline fault_hook_t active_fault_hook = nullptr;
+
+/// @note: for crash tests, nullptr turns it off again. With no hook
+/// installed a fault point costs a load and a branch
+inline void set_fault_hook(fault_hook_t hook) { active_fault_hook = hook; }
+
+inline void inject_fault(FaultPoint point, uint16_t sem_numid) {
+    if (active_fault_hook != nullptr) {
+        active_fault_hook(point, sem_numid);
+    }
+}
+
+} // namespace lap
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+/// @note: watches every process that holds, waits on or leases permits of
+/// a SemaphoreSet through a pidfd, from a thread of the process that
+/// creates it. The moment one exits, whatever it left behind is given
+/// back with SemaphoreSet::reclaim_dead and its waiters are woken, instead
+/// of when some later Swait stumbles over it. Needs Linux 5.3 or later
+///
+/// @note: a process that shows up is watched from the next scan, at most
+/// kScanMs later. A holder that hangs is not touched, see leases and
+/// SemSetConfig::long_hold_ns for those
+class HolderReaper {
+  private:
+    SemaphoreSet &sem_set;
+    std::atomic< bool > stopping{false};
+    std::atomic< uint64_t > reclaimed{0};
+    pid_t owner; // the only process that runs the reaper thread
+    std::unique_ptr< std::thread > reaper;
+
+    void run();
+
+  public:
+    explicit HolderReaper(SemaphoreSet &sem_set);
+
+    /// dead processes whose permits were reclaimed so far
+    uint64_t getReclaimed() const;
+
+    ~HolderReaper();
+};
+
+} // namespace lap
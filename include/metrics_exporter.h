@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+/// (semname_id, label), semaphores missing from it are labelled by the
+/// name given with SemaphoreSet::setName, or else by number
+using sem_label_map_t = std::unordered_map< sem_nameid_t, std::string >;
+
+/// @note: serves the statistics of a SemaphoreSet in the Prometheus text
+/// exposition format on a Unix domain socket, from a thread of the
+/// process that creates it. A request starting with "GET " is answered
+/// as HTTP, anything else, or nothing at all, gets the bare text
+///
+/// @note: a scrape only loads the atomics of the control block and does
+/// one GETALL, it never takes the control block lock
+class MetricsExporter {
+  private:
+    const SemaphoreSet &sem_set;
+    sem_label_map_t sem_labels;
+    std::string socket_path;
+    int32_t listen_fd = -1;
+    std::atomic< bool > stopping{false};
+    pid_t owner; // the only process that runs the server thread
+    std::unique_ptr< std::thread > server;
+
+    void serve();
+    void answer(int32_t conn_fd);
+
+  public:
+    MetricsExporter(const SemaphoreSet &sem_set, const char *socket_path,
+      sem_label_map_t sem_labels = {});
+
+    /// one scrape worth of metrics
+    void write_metrics(std::ostream &os) const;
+    std::string render() const;
+
+    ~MetricsExporter();
+};
+
+} // namespace lap
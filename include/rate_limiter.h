@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+/// refill rate (permits per second) and bucket size of one bucket
+struct BucketConfig {
+    double rate;
+    int32_t burst;
+};
+
+/// (bucket_id, config)
+using bucket_config_map_t = std::unordered_map< sem_nameid_t, BucketConfig >;
+
+/// @note: token buckets shared by forked processes. The tokens of a
+/// bucket are the permits of its semaphore in a SemaphoreSet, so they show
+/// up in its stats, traces and semset-top like any other. Every bucket is
+/// refilled lazily by whoever acquires from it, under a lock semaphore of
+/// the same set, computed from the time of its last refill. There is no
+/// refill thread.
+///
+/// @note: a process that finds a bucket short queues on the line
+/// semaphore of that bucket, only the first in line sleeps until its
+/// tokens are earned. A spent token does not come back when the process
+/// exits, the lock and its place in line do
+class RateLimiter {
+  private:
+    int32_t num_buckets;
+    std::vector< BucketConfig > configs; // the same in every process
+
+    /// the buckets 0 .. n-1, a line per bucket n .. 2n-1, then the lock
+    SemaphoreSet sem_set;
+    sem_nameid_t lock_numid;
+
+    /// time the tokens of each bucket were last topped up, shared with
+    /// every forked process
+    std::atomic< int64_t > *refilled_ns = nullptr;
+
+    sem_nameid_t line_of(sem_nameid_t bucket_id) const;
+
+    /// @note: false, after logging why, for a bucket that does not exist
+    /// or a number of permits it can never hand out
+    bool check_request(sem_nameid_t bucket_id, int32_t permits) const;
+
+    /// @note: requires the lock, returns the tokens left in the bucket
+    int32_t refill(sem_nameid_t bucket_id, int64_t now_ns);
+
+    /// @note: requires the lock, returns 0 when the tokens are taken or
+    /// how long to sleep until enough of them have been refilled
+    int64_t take_or_wait_ns(sem_nameid_t bucket_id, int32_t permits);
+
+  public:
+    RateLimiter(const bucket_config_map_t &bucket_configs);
+
+    /// @note: block until `permits` tokens are available in the bucket.
+    /// False, with nothing taken, for a bucket that does not exist or
+    /// more permits than its burst
+    bool Swait(
+      sem_nameid_t bucket_id, int32_t permits = 1, CallSite site = {});
+
+    /// take `permits` tokens if they are available right now
+    bool Strywait(
+      sem_nameid_t bucket_id, int32_t permits = 1, CallSite site = {});
+
+    int32_t getVal(sem_nameid_t bucket_id) const;
+
+    /// the set the tokens live in, for its stats and traces
+    SemaphoreSet &getSemaphoreSet();
+
+    ~RateLimiter();
+};
+
+} // namespace lap
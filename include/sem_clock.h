@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+namespace lap {
+
+/// @note: CLOCK_MONOTONIC is the same clock for every process on the
+/// machine, so stamps taken by one process can be compared by another
+inline int64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/// a duration in the largest unit that keeps it above 1, for reports
+inline std::string format_ns(int64_t ns) {
+    char buf[32];
+    if (ns < 1000) {
+        std::snprintf(buf, sizeof(buf), "%ldns", (long)ns);
+    }
+    else if (ns < 1000000) {
+        std::snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    }
+    else if (ns < 1000000000) {
+        std::snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    }
+    else {
+        std::snprintf(buf, sizeof(buf), "%.1fs", ns / 1e9);
+    }
+    return buf;
+}
+
+} // namespace lap
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "sem_stats.h"
+
+namespace lap {
+
+/// max processes that can be parked on one SemaphoreSet at the same time
+constexpr int32_t kMaxWaiters = 64;
+
+/// max entries of a single Swait request a parked process can leave behind
+constexpr int32_t kMaxWaitOps = 8;
+
+/// max leased acquisitions alive at the same time
+constexpr int32_t kMaxLeases = 64;
+
+/// max distinct processes recorded as holding one semaphore
+constexpr int32_t kMaxHolders = 16;
+
+/// room for the "file:line" of the Swait a holder acquired from
+constexpr int32_t kHolderSiteLen = 48;
+
+/// max call sites of holders whose "file:line" the control block keeps
+constexpr int32_t kMaxSiteNames = 128;
+
+/// max kernel sets the semaphores of one SemaphoreSet are spread over
+constexpr int32_t kMaxShards = 512;
+
+/// room for the name of a semaphore, the last byte is always 0
+constexpr int32_t kSemNameLen = 32;
+
+/// largest value a SysV semaphore can hold (SEMVMX), and so a capacity
+constexpr int32_t kMaxSemValue = 32767;
+
+/// one entry of a parked Swait request
+struct WaitOp {
+    uint16_t sem_numid;
+    int16_t sem_op;
+    int32_t min_val;
+};
+
+/// @note: a process parked in Swait, recorded in shared memory so that
+/// Ssignal can hand the released permits straight to it
+struct WaiterSlot {
+    std::atomic< pid_t > pid;          /// 0 when the slot is free
+    int32_t granted;                   /// permits were reserved for it
+    std::atomic< int32_t > blocked_on; /// the semaphore that made it park
+    std::atomic< int32_t > aborted;    /// picked as a deadlock victim
+    uint64_t ticket; /// arrival order, the oldest waiter is served first
+    int32_t num_ops;
+    WaitOp ops[kMaxWaitOps];
+};
+
+enum LeaseState : int32_t { LEASE_FREE = 0, LEASE_CLAIMED, LEASE_ACTIVE,
+    LEASE_BUSY };
+
+/// bits of a lease_id_t that hold the slot, the rest holds its generation
+constexpr int32_t kLeaseIndexBits = 8;
+static_assert(kMaxLeases <= 1 << kLeaseIndexBits);
+
+/// generations wrap so that a lease_id_t stays a non-negative int32_t
+constexpr uint32_t kLeaseGenMask = (1u << (31 - kLeaseIndexBits)) - 1;
+
+/// @note: permits taken with a TTL. They are held without SEM_UNDO and
+/// given back by whoever finds the lease expired or its owner gone.
+/// Every claim of the slot bumps its generation, and the generation is
+/// part of the state word, so a stale lease_id_t never matches the lease
+/// that reuses the slot
+struct LeaseSlot {
+    std::atomic< uint64_t > state; /// generation << 32 | LeaseState
+    pid_t owner;
+    int64_t ttl_ns;
+    std::atomic< int64_t > expires_ns;
+    int32_t num_ops;
+    WaitOp ops[kMaxWaitOps];
+};
+
+inline uint64_t lease_word(uint32_t generation, LeaseState state) {
+    return (uint64_t)generation << 32 | (uint32_t)state;
+}
+
+inline LeaseState lease_state(uint64_t word) {
+    return (LeaseState)(uint32_t)word;
+}
+
+inline uint32_t lease_generation(uint64_t word) { return word >> 32; }
+
+/// @note: the "file:line" of one call site, written once per site. A
+/// copy and not a pointer, other processes may have the binary mapped
+/// elsewhere. The last byte is never written
+struct SiteName {
+    std::atomic< uint32_t > state; /// 0 free, 1 being written, 2 ready
+    char text[kHolderSiteLen];
+};
+
+/// a process holding permits of one semaphore
+struct HolderSlot {
+    std::atomic< pid_t > pid; /// 0 when the slot is free
+    std::atomic< int32_t > count;
+    std::atomic< int64_t > since_ns; /// its latest acquisition
+    /// @note: the entry of the site of that acquisition in
+    /// ControlBlock::site_names plus 1, 0 when unknown
+    std::atomic< int32_t > site;
+};
+
+/// per semaphore bookkeeping
+struct SemSlot {
+    uint16_t name;    /// the id callers know the semaphore by
+    int32_t reserved; /// permits handed off but not picked up yet
+    char label[kSemNameLen]; /// empty until SemaphoreSet::setName
+    std::atomic< int32_t > capacity; /// total permits after the last resize
+    std::atomic< int32_t > debt;     /// permits a shrink still has to swallow
+    std::atomic< int32_t > value;    /// threads backend only, see `threads`
+    std::atomic< uint32_t > epoch;   /// threads backend, bumped by releases
+    std::atomic< int32_t > sleepers; /// threads backend, blocked on `value`
+    /// @note: taken holder slots, may count one too many for a process
+    /// that died in between, never one too few. 0 skips the scan
+    std::atomic< int32_t > num_holders;
+    HolderSlot holders[kMaxHolders];
+    SemStats stats;
+};
+
+/// @note: shared by every process of a set, it lives in a MAP_SHARED
+/// mapping, or in a SysV shared memory segment under the set's key so
+/// tools can attach to it, and is followed by `num_sems` SemSlot
+struct ControlBlock {
+    static constexpr uint32_t kMagic = 0x53454d53; // "SEMS"
+
+    uint32_t magic;
+    std::atomic< int32_t > ready; /// set last by the creator
+    int32_t num_sems;
+    int32_t shard_size; /// semaphores per kernel set, the last may be short
+    int32_t num_shards;
+    int32_t semids[kMaxShards]; /// the sets holding the permits
+    /// @note: one semaphore per waiter slot to park on, plus the lock in
+    /// hand-off mode. Made with the set in hand-off mode, by the first
+    /// process that has to park otherwise, -1 until then
+    std::atomic< int32_t > park_semid;
+    int32_t handoff;
+    /// @note: threads backend, the values are in the SemSlots and not in
+    /// any kernel set. Threads sleep on the epoch of the semaphore that is
+    /// short, bumped by every release of it
+    int32_t threads;
+    int64_t create_ns; /// how long the constructor of the creator took
+    pid_t creator;
+    std::atomic< uint64_t > next_ticket;
+    std::atomic< int32_t > num_waiters; /// taken waiter slots, 0 skips scans
+    WaiterSlot waiters[kMaxWaiters];
+    std::atomic< int32_t > live_leases;
+    LeaseSlot leases[kMaxLeases];
+    std::atomic< int64_t > last_long_hold_warn_ns;
+    SiteName site_names[kMaxSiteNames];
+
+    /// "file:line" of a HolderSlot::site, "?" when unknown
+    const char *site_name(int32_t site) const {
+        if (site <= 0 || site > kMaxSiteNames ||
+            this->site_names[site - 1].state.load(std::memory_order_acquire) !=
+              2)
+        {
+            return "?";
+        }
+        return this->site_names[site - 1].text;
+    }
+
+    SemSlot *sems() { return reinterpret_cast< SemSlot * >(this + 1); }
+    const SemSlot *sems() const {
+        return reinterpret_cast< const SemSlot * >(this + 1);
+    }
+
+    /// @note: the name registry follows the SemSlots, an open-addressing
+    /// table of name_slots_for(num_sems) entries holding the index of the
+    /// named semaphore plus 1, 0 when the entry is free
+    std::atomic< int32_t > *names() {
+        return reinterpret_cast< std::atomic< int32_t > * >(
+          this->sems() + this->num_sems);
+    }
+    const std::atomic< int32_t > *names() const {
+        return reinterpret_cast< const std::atomic< int32_t > * >(
+          this->sems() + this->num_sems);
+    }
+
+    /// a power of two, at least twice the semaphores
+    static int32_t name_slots_for(int32_t num_sems) {
+        int32_t slots = 2;
+        while (slots < 2 * num_sems) {
+            slots <<= 1;
+        }
+        return slots;
+    }
+
+    static size_t size_for(int32_t num_sems) {
+        return sizeof(ControlBlock) + num_sems * sizeof(SemSlot) +
+               name_slots_for(num_sems) * sizeof(std::atomic< int32_t >);
+    }
+};
+
+} // namespace lap
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace lap {
+
+/// @note: multiplicative hashing of a 16-bit id into 2^bits slots, the
+/// top bits of the product are the best mixed ones
+constexpr uint32_t sem_id_slot(
+  uint16_t id, uint32_t multiplier, int32_t bits) {
+    return (uint32_t)(id * multiplier) >> (32 - bits);
+}
+
+constexpr uint32_t kFibonacciMultiplier = 2654435769u;
+
+/// multiplier and table size of a perfect hash, bits 0 when none found
+struct SemIdHashParams {
+    int32_t bits;
+    uint32_t multiplier;
+};
+
+/// @note: the smallest table first, at least twice the ids, and a few
+/// hundred odd multipliers for each size. Pairwise checks, the sets this
+/// is meant for are small
+template < size_t N >
+constexpr SemIdHashParams find_perfect_sem_id_hash(
+  const std::array< uint16_t, N > &ids) {
+    int32_t bits = 1;
+    while ((1 << bits) < 2 * (int32_t)N) {
+        ++bits;
+    }
+    for (; bits <= 16; ++bits) {
+        for (uint32_t k = 0; k < 256; ++k) {
+            uint32_t multiplier = kFibonacciMultiplier + 2 * k;
+            bool collision      = false;
+            for (size_t i = 0; i < N && !collision; ++i) {
+                for (size_t j = i + 1; j < N && !collision; ++j) {
+                    collision = sem_id_slot(ids[i], multiplier, bits) ==
+                                sem_id_slot(ids[j], multiplier, bits);
+                }
+            }
+            if (!collision) {
+                return {bits, multiplier};
+            }
+        }
+    }
+    return {0, 0};
+}
+
+template < size_t Slots, size_t N >
+constexpr std::array< int32_t, Slots > build_perfect_sem_id_table(
+  const std::array< uint16_t, N > &ids, SemIdHashParams params) {
+    std::array< int32_t, Slots > table = {};
+    for (auto &slot : table) {
+        slot = -1;
+    }
+    for (size_t i = 0; i < N; ++i) {
+        table[sem_id_slot(ids[i], params.multiplier, params.bits)] = i;
+    }
+    return table;
+}
+
+/// @note: a perfect hash of `Ids`, searched for at compile time. Every id
+/// gets a slot of its own under `multiplier`, so a lookup is one probe.
+/// The dense index of an id is its position in `Ids`
+template < uint16_t... Ids >
+struct StaticSemIdMap {
+    static constexpr int32_t size = sizeof...(Ids);
+    static_assert(size > 0, "a StaticSemIdMap needs at least one id");
+
+    static constexpr std::array< uint16_t, size > ids = {Ids...};
+    static constexpr SemIdHashParams params = find_perfect_sem_id_hash(ids);
+    static_assert(params.bits != 0, "no perfect hash found for these ids");
+
+    static constexpr std::array< int32_t, (1 << params.bits) > slots =
+      build_perfect_sem_id_table< (1 << params.bits) >(ids, params);
+
+    /// dense index of `id`, -1 when it is not one of `Ids`
+    static constexpr int32_t index_of(uint16_t id) {
+        int32_t index = slots[sem_id_slot(id, params.multiplier, params.bits)];
+        return index != -1 && ids[index] == id ? index : -1;
+    }
+};
+
+/// @note: semaphore ids to the dense indices of the kernel sets and the
+/// control block. Ids 0..n-1 map onto themselves without a table, any
+/// other set of ids goes through a flat open-addressing table with linear
+/// probing, at most half full
+class SemIdMap {
+  private:
+    bool dense = true;
+    int32_t bits = 0;
+    uint32_t multiplier = kFibonacciMultiplier;
+    std::vector< int32_t > slots; // dense index, -1 when free
+    std::vector< uint16_t > ids;  // id of every dense index
+
+    void insert(int32_t index);
+    void build();
+
+  public:
+    SemIdMap() = default;
+
+    /// dense indices in ascending order of the ids
+    explicit SemIdMap(std::vector< uint16_t > ids);
+
+    /// @note: `ids[i]` gets index i, how an attaching process rebuilds
+    /// the map of the creator from the control block
+    static SemIdMap in_index_order(std::vector< uint16_t > ids);
+
+    /// the perfect hash of a StaticSemIdMap, dense indices in its order
+    template < uint16_t First, uint16_t... Rest >
+    SemIdMap(StaticSemIdMap< First, Rest... > map)
+        : dense(false), bits(map.params.bits),
+          multiplier(map.params.multiplier),
+          slots(map.slots.begin(), map.slots.end()),
+          ids(map.ids.begin(), map.ids.end()) {}
+
+    /// dense index of `id`, -1 when the set has no such semaphore
+    int32_t find(uint16_t id) const {
+        if (this->dense) {
+            return id < this->ids.size() ? id : -1;
+        }
+        uint32_t mask = (1u << this->bits) - 1;
+        for (uint32_t slot = sem_id_slot(id, this->multiplier, this->bits);;
+             slot = (slot + 1) & mask)
+        {
+            int32_t index = this->slots[slot];
+            if (index == -1 || this->ids[index] == id) {
+                return index;
+            }
+        }
+    }
+
+    /// every id is its own index, nothing has to be translated
+    bool is_dense() const { return this->dense; }
+
+    int32_t size() const { return this->ids.size(); }
+    uint16_t id_of(int32_t index) const { return this->ids[index]; }
+};
+
+} // namespace lap
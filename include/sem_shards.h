@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+#include "sem_control_block.h"
+
+namespace lap {
+
+/// the SysV semaphore limits of the running kernel
+struct SemLimits {
+    int32_t semmsl; /// semaphores per set
+    int32_t semmns; /// semaphores system wide
+    int32_t semopm; /// operations per semop call
+    int32_t semmni; /// sets system wide
+};
+
+/// @note: parsed from /proc/sys/kernel/sem, the defaults of current
+/// kernels when it can not be read
+SemLimits read_sem_limits();
+
+/// @note: GETALL over every kernel set of a SemaphoreSet, `vals` gets
+/// `num_sems` values. False when a set is gone. A set of the threads
+/// backend is read from the control block
+bool get_all_values(const ControlBlock *ctrl, unsigned short *vals);
+
+/// @note: GETALL over kernel set `shard` alone, `vals` gets the values of
+/// its semaphores. False when the set is gone
+bool get_shard_values(
+  const ControlBlock *ctrl, int32_t shard, unsigned short *vals);
+
+} // namespace lap
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+/// one thing a simulated process does
+struct SimAction {
+    enum Kind : uint8_t {
+        SWAIT = 0,
+        SSIGNAL,
+        ENTER_SHARED, /// start reading, checked against the invariants
+        LEAVE_SHARED,
+        ENTER_EXCLUSIVE, /// start writing
+        LEAVE_EXCLUSIVE,
+    };
+
+    Kind kind;
+    sem_nameid_min_val_vec_t request = {}; /// SWAIT
+    sem_nameid_t sem_numid           = 0;  /// SSIGNAL
+    int16_t sem_op                   = 1;  /// SSIGNAL
+};
+
+using sim_program_t = std::vector< SimAction >;
+
+struct SimConfig {
+    bool handoff = false; /// the protocol to model, see SemSetConfig
+    std::vector< int32_t > initial_values; /// one per semaphore
+    std::vector< sim_program_t > programs; /// one per process
+
+    /// invariant: at most this many processes inside a shared section,
+    /// never one in a shared and one in an exclusive section, never two
+    /// in an exclusive one
+    int32_t max_shared = INT32_MAX;
+
+    /// a schedule running longer than this is reported as a livelock
+    uint64_t max_steps = 1 << 20;
+
+    /// keep a line per step in SimResult::trace, slow
+    bool record_trace = false;
+};
+
+struct SimResult {
+    bool ok;
+    std::string failure; /// what went wrong, empty when ok
+    uint64_t steps;
+    std::vector< std::string > trace;
+};
+
+/// @note: an in-process model of the Swait/Ssignal protocols of
+/// SemaphoreSet against a simulated SysV kernel. Every step is one syscall
+/// or one access to the control block of the real implementation, and a
+/// seeded scheduler picks which process takes the next one, so a failing
+/// seed replays the very same interleaving.
+///
+/// @note: a model only, written by hand after the protocol and not run
+/// against the code. It knows one kernel set and one park set made up
+/// front, so shards, a lazily created park set, pending shrinks,
+/// the threads backend and the reaper are not in it, nor are timeouts,
+/// leases, crashes and SEM_UNDO. Hand-off mode runs every section under
+/// the control block lock as a single step. A clean run of the model says
+/// nothing about SemaphoreSet itself, `semset-sim -R` runs the same
+/// programs on the real code for that
+class SimSemaphoreSet {
+  private:
+    enum SimSetId : int32_t { SIM_MAIN = 0, SIM_PARK };
+
+    /// one operation of a semop on a simulated set
+    struct SimOp {
+        int32_t sem_num;
+        int32_t sem_op;
+    };
+
+    static constexpr int32_t kMaxSimOps = 2 * kMaxWaitOps;
+
+    struct Process {
+        size_t pc;          // index of the current action
+        int32_t phase;      // step within the action
+        int32_t index;      // loop counter within the phase
+        int32_t blocked_on; // the semaphore it parks on
+        std::vector< int32_t > wake; // parked waiters a Ssignal found
+        bool registered;    // in the waiter table
+        bool granted;       // hand-off: permits reserved for it
+        std::vector< int32_t > held; // hand-off: permits it holds per sem
+        uint64_t ticket;
+
+        bool blocked;        // in a semop the kernel can not complete
+        int32_t wait_set;    // the semop it is blocked in
+        int32_t num_wait_ops;
+        SimOp wait_ops[kMaxSimOps];
+        int32_t resume_phase; // phase once that semop completes
+    };
+
+    SimConfig config;
+    std::vector< int32_t > values[2]; // main and park sets
+    std::vector< int32_t > reserved;  // hand-off reservations per sem
+    std::vector< Process > procs;
+    std::vector< int32_t > runnable;
+    std::vector< int32_t > blocked; // oldest first, the kernel is FIFO
+    uint64_t next_ticket;
+    int32_t num_shared;
+    int32_t num_exclusive;
+    int32_t num_finished;
+    SimResult result;
+
+    void reset();
+    void note(int32_t pid, const std::string &what);
+    void fail(int32_t pid, const std::string &why);
+
+    /// all or nothing like the kernel, false when it would block
+    bool try_semop(int32_t set, const SimOp *ops, int32_t num_ops);
+
+    /// @note: a semop that may block, the process continues at
+    /// `resume_phase` once the kernel completes it
+    void semop(int32_t pid, int32_t set, const SimOp *ops, int32_t num_ops,
+      int32_t resume_phase);
+
+    /// complete the blocked semops that fit now, oldest first
+    void update_queue();
+
+    void finish_action(Process &proc);
+    void step(int32_t pid);
+    void step_legacy_wait(int32_t pid, const SimAction &action);
+    void step_legacy_signal(int32_t pid, const SimAction &action);
+    void step_handoff_wait(int32_t pid, const SimAction &action);
+    void step_handoff_signal(int32_t pid, const SimAction &action);
+    void grant_waiters(int32_t pid);
+    void step_section(int32_t pid, const SimAction &action);
+
+  public:
+    SimSemaphoreSet(SimConfig config);
+
+    /// run every program to its end under the schedule of `seed`
+    const SimResult &run(uint64_t seed);
+};
+
+} // namespace lap
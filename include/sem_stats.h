@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace lap {
+
+/// @note: log2 buckets, bucket b counts durations in [2^b, 2^(b+1)) ns,
+/// the last one everything from ~9 minutes up
+constexpr int32_t kHistBuckets = 40;
+
+/// lock-free latency histogram that can live in shared memory
+struct LatencyHistogram {
+    std::atomic< uint64_t > buckets[kHistBuckets];
+    std::atomic< uint64_t > sum_ns;
+
+    static int32_t bucket_of(int64_t ns) {
+        if (ns <= 1) {
+            return 0;
+        }
+        int32_t b = 63 - __builtin_clzll((uint64_t)ns);
+        return b < kHistBuckets ? b : kHistBuckets - 1;
+    }
+
+    void record(int64_t ns) {
+        buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        if (ns != 0) {
+            sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        }
+    }
+
+    void load(uint64_t (&out)[kHistBuckets]) const {
+        for (int32_t b = 0; b < kHistBuckets; ++b) {
+            out[b] = buckets[b].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+/// upper bound in ns of the bucket holding quantile `q` of `counts`,
+/// 0 when there are no samples
+inline int64_t hist_percentile(
+  const uint64_t (&counts)[kHistBuckets], double q) {
+    uint64_t total = 0;
+    for (uint64_t count : counts) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(q * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int32_t b = 0; b < kHistBuckets; ++b) {
+        seen += counts[b];
+        if (seen >= rank) {
+            return 2LL << b;
+        }
+    }
+    return 2LL << (kHistBuckets - 1);
+}
+
+/// per semaphore counters, written on the hot path with relaxed atomics
+struct SemStats {
+    std::atomic< uint64_t > acquisitions;
+    std::atomic< uint64_t > parks;
+    std::atomic< uint64_t > timeouts; /// timed parks that ran out
+    LatencyHistogram wait_ns; /// Swait entry to acquisition
+    LatencyHistogram hold_ns; /// acquisition to Ssignal
+};
+
+} // namespace lap
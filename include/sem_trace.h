@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace lap {
+
+enum TraceOp : uint8_t {
+    TRACE_WAIT_BEGIN = 0, /// Swait entered, sem is the first of the request
+    TRACE_PARK,           /// parked, sem is the one that blocked it
+    TRACE_ACQUIRE,        /// value permits of sem taken
+    TRACE_ABORT,          /// Swait failed as a deadlock victim
+    TRACE_SIGNAL,         /// Ssignal of value permits
+    TRACE_RECLAIM,        /// value permits of an expired lease or a dead
+                          /// process given back
+    TRACE_RESIZE,         /// capacity of sem set to value
+};
+
+/// outcome of TRACE_ACQUIRE
+enum TraceOutcome : uint8_t {
+    TRACE_FAST = 0, /// without parking
+    TRACE_WOKEN,    /// after parking at least once
+};
+
+/// @note: one fixed-size event, no pointers so a dumped ring can be
+/// decoded by another process
+struct TraceRecord {
+    int64_t ts_ns; /// CLOCK_MONOTONIC
+    int32_t pid;
+    uint16_t sem_numid;
+    uint8_t op;      /// TraceOp
+    uint8_t outcome; /// TraceOutcome
+    int32_t value;
+    uint32_t seq; /// low bits of its ring position + 1 once fully written
+};
+
+static_assert(sizeof(TraceRecord) == 24, "trace records must stay packed");
+
+/// @note: a lock-free ring in shared memory, writers claim a position
+/// with a fetch_add and publish the record by storing its seq last.
+/// Old records are overwritten once the ring wraps
+struct TraceRing {
+    static constexpr uint32_t kMagic = 0x53455452; // "SETR"
+
+    uint32_t magic;
+    uint32_t capacity; /// power of two
+    std::atomic< uint64_t > head;
+
+    TraceRecord *records() {
+        return reinterpret_cast< TraceRecord * >(this + 1);
+    }
+
+    static size_t size_for(uint32_t capacity) {
+        return sizeof(TraceRing) + capacity * sizeof(TraceRecord);
+    }
+
+    void write(int64_t ts_ns, int32_t pid, uint16_t sem_numid, uint8_t op,
+      uint8_t outcome, int32_t value) {
+        uint64_t pos    = head.fetch_add(1, std::memory_order_relaxed);
+        TraceRecord &rd = records()[pos & (capacity - 1)];
+        __atomic_store_n(&rd.seq, 0, __ATOMIC_RELAXED);
+        /// @note: keeps the stores below from showing up before the 0, a
+        /// reader that copies them half done sees seq change and drops it
+        std::atomic_thread_fence(std::memory_order_release);
+        rd.ts_ns     = ts_ns;
+        rd.pid       = pid;
+        rd.sem_numid = sem_numid;
+        rd.op        = op;
+        rd.outcome   = outcome;
+        rd.value     = value;
+        __atomic_store_n(&rd.seq, (uint32_t)(pos + 1), __ATOMIC_RELEASE);
+    }
+
+    /// the complete records still in the ring, oldest first
+    std::vector< TraceRecord > snapshot();
+};
+
+const char *trace_op_name(uint8_t op);
+
+/// @note: dump format is the TraceRing header followed by the records
+/// returned by snapshot()
+bool write_trace_file(TraceRing &ring, const char *path);
+std::vector< TraceRecord > read_trace_file(const char *path);
+
+/// @note: Chrome trace-event JSON, loadable by chrome://tracing and
+/// Perfetto. One track per pid, a slice from Swait to the acquisition
+/// with the parked part nested inside, and an async slice per hold from
+/// the acquisition to the matching Ssignal
+void export_chrome_trace(
+  const std::vector< TraceRecord > &records, std::ostream &os);
+
+} // namespace lap
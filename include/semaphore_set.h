@@ -4,16 +4,28 @@
 #include <sys/ipc.h>
 #include <sys/mman.h>
 #include <sys/sem.h>
+#include <unistd.h>
 
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
+#include <mutex>
 
 #if __cplusplus >= 202002L
 #include <source_location>
 #endif
 
+#include <string>
 #include <unordered_map>
+#include <vector>
+
+#include "call_site_stats.h"
+#include "fault_injection.h"
+#include "sem_clock.h"
+#include "sem_control_block.h"
+#include "sem_id_map.h"
+#include "sem_trace.h"
 
 namespace lap {
 
@@ -22,7 +34,7 @@ using sem_nameid_t = uint16_t;
 /// (semname_id, initial_value)
 using sem_name_id_map_t = std::unordered_map< sem_nameid_t, int32_t >;
 
-using SemIdToReduce = struct {
+struct SemIdToReduce {
     int32_t min_val; /// min resource value
     int32_t sem_op;  /// operation to semaphore
 };
@@ -30,16 +42,139 @@ using SemIdToReduce = struct {
 using sem_nameid_min_val_vec_t =
   std::vector< std::pair< sem_nameid_t, SemIdToReduce > >;
 
+/// @note: what a semaphore must hold for one entry of a Swait to go
+/// through, min_val but at least the -sem_op the kernel takes
+inline int32_t needed_value(int32_t min_val, int32_t sem_op) {
+    return min_val > -sem_op ? min_val : -sem_op;
+}
+
+/// generation << kLeaseIndexBits | index of a lease in the control
+/// block, -1 when none
+using lease_id_t = int32_t;
+
+/// construction options of a SemaphoreSet
+struct SemSetConfig {
+    /// @note: Ssignal hands the released permits straight to the oldest
+    /// eligible waiter, woken processes never race newcomers again
+    bool handoff = false;
+
+    /// @note: a parked process checks the wait-for graph every this many
+    /// ns, 0 only checks on demand with detect_deadlocks()
+    int64_t deadlock_check_ns = 0;
+
+    /// fail the Swait of one process of every cycle found
+    bool break_deadlocks = false;
+
+    /// @note: events kept in the binary trace ring, rounded up to a power
+    /// of two. 0 turns tracing off
+    uint32_t trace_capacity = 0;
+
+    /// @note: warn when a permit is held longer than this many ns, with
+    /// the holder and the call site it was taken from. 0 turns it off
+    int64_t long_hold_ns = 0;
+
+    /// at most one long-hold warning per this many ns across the set
+    int64_t long_hold_warn_interval_ns = 1000000000;
+
+    /// @note: semaphores per kernel set, 0 takes SEMMSL. A SemaphoreSet
+    /// with more is spread over several kernel sets
+    int32_t max_sems_per_set = 0;
+
+    /// operations per semop call, 0 takes SEMOPM
+    int32_t max_ops_per_semop = 0;
+
+    /// @note: keep the control block in this file, e.g. under /dev/shm,
+    /// instead of shared memory. A set created again over the file of the
+    /// same set keeps its capacities, names and statistics. Attaching
+    /// processes pass the same path
+    std::string state_path;
+
+    /// @note: for threads of one process only. The values stay in this
+    /// process and threads block with atomic wait/notify, no SysV call at
+    /// all. Needs IPC_PRIVATE and no hand-off, leases, deadlock checks or
+    /// long-hold warnings, hold times are not recorded. A forked child
+    /// gets a copy of the set and not the set
+    bool threads = false;
+};
+
+/// tag of the constructor that joins a set created under a key
+struct attach_t {
+    explicit attach_t() = default;
+};
+inline constexpr attach_t attach{};
+
+/// processes of one deadlock, each waits on a semaphore only the others hold
+using deadlock_cycle_t = std::vector< pid_t >;
+
 class SemaphoreSet {
   private:
     static const int8_t Psemop = -1; // semaphore operation for P
     static const int8_t Vsemop = 1;  // semaphore operation for V
-    int32_t semid;                   // semaphore set ID
     int32_t num_sems;                // number of semaphores in the set
     int32_t inner_sem_numid;         // inner semaphore number id
 
-    int32_t block_oneself_semid;       // to block oneself
-    int16_t **ptr_record_who_block_me; // to record who block me
+    /// @note: semaphore n is number n % shard_size of the kernel set
+    /// n / shard_size
+    int32_t shard_size;
+    int32_t max_semop;             // operations per semop call
+    std::vector< int32_t > semids; // semaphore set IDs
+
+    SemSetConfig config;
+    int32_t park_semid = -1;      // one semaphore per waiter slot + lock
+    ControlBlock *ctrl = nullptr; // shared with every forked process
+    int32_t ctrl_shmid = -1;      // the key's shm segment, if mapped from it
+    TraceRing *trace_ring = nullptr; // binary events, null when off
+    int64_t construct_ns  = 0;       // see getConstructNs()
+    bool owns_mappings    = true;    // false for clone_for_child()
+    bool owns_sets        = false;   // made the set, removes it when done
+    pid_t self_pid        = 0; // getpid() once, see reset_process_state
+
+    /// @note: threads backend, serializes the requests on more than one
+    /// semaphore. Single ones and releases do not take it
+    std::shared_ptr< std::mutex > thread_lock;
+
+    /// @note: the public API takes semaphore ids, everything below it
+    /// works on dense indices 0..num_sems-1, see resolve()
+    SemIdMap ids;
+
+    /// @note: per process, when this process last took each semaphore
+    /// and from where, so Ssignal can charge the hold to that call site.
+    /// `holder` is where its holder slot was last time, see find_holder
+    struct HeldBy {
+        int64_t since_ns    = 0;
+        CallSiteStats *site = nullptr;
+        HolderSlot *holder  = nullptr;
+    };
+    std::vector< HeldBy > held_by;
+
+    /// @note: per call_site_index, the site_of each call site in this
+    /// set, -1 until it is interned
+    std::vector< int32_t > site_ids =
+      std::vector< int32_t >(kMaxCallSites + 1, -1);
+
+    void trace(uint8_t op, sem_nameid_t sem_numid, int32_t value,
+      uint8_t outcome = TRACE_FAST) {
+        if (this->trace_ring != nullptr) {
+            this->trace_ring->write(monotonic_ns(), this->self_pid,
+              this->ids.id_of(sem_numid), op, outcome, value);
+        }
+    }
+
+    int32_t semid_of(sem_nameid_t sem_numid) const {
+        return this->semids[sem_numid / this->shard_size];
+    }
+    unsigned short index_of(sem_nameid_t sem_numid) const {
+        return sem_numid % this->shard_size;
+    }
+
+    /// @note: semop on the kernel set of ops[0] out of `sets`, every op
+    /// must be in that set. Rewrites sem_num to the index within it
+    int32_t shard_semop(
+      const std::vector< int32_t > &sets, sembuf *ops, int32_t num_ops);
+
+    /// @note: the ops of one request, all or nothing like a single semop.
+    /// Ops on the same semaphore must share their flags
+    int32_t request_semop(sembuf *ops, int32_t num_ops);
 
     using semun = union {
         int val;               /* Value for SETVAL */
@@ -58,7 +193,8 @@ class SemaphoreSet {
 
     /// @note: use to block oneself
     /// when we find the resource is not enough to distribute(value < min_val),
-    void block_oneself_or_release(sem_nameid_t who, int16_t sem_op,
+    /// on the park semaphore of waiter slot `who`, without SEM_UNDO
+    void block_oneself_or_release(int32_t who, int16_t sem_op,
       std::source_location loc = std::source_location::current());
 
 #else
@@ -68,11 +204,141 @@ class SemaphoreSet {
 
     /// @note: use to block oneself
     /// when we find the resource is not enough to distribute(value < min_val),
-    void block_oneself_or_release(sem_nameid_t who, int16_t sem_op);
+    /// on the park semaphore of waiter slot `who`, without SEM_UNDO
+    void block_oneself_or_release(int32_t who, int16_t sem_op);
 #endif
 
+    /// @note: P/V on the lock guarding the control block, SEM_UNDO
+    /// releases it if the owner dies while holding it
     void mantain_atomic(int16_t sem_op);
 
+    /// @note: hand-off mode, requires the control block lock. Returns
+    /// the first semaphore that can not grant the request, -1 if none
+    int32_t find_blocker(const sem_nameid_min_val_vec_t &sem_op_min_val_vector);
+    void apply_ops(const WaitOp *ops, int32_t num_ops, bool reserved,
+      int64_t wait_begin_ns, CallSiteStats *caller);
+    void grant_waiters();
+    bool grant_holds(const WaiterSlot &waiter);
+    void revoke_grant(WaiterSlot &waiter);
+    bool handoff_wait(const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+      int64_t wait_begin_ns, CallSiteStats *caller);
+    bool legacy_wait(const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+      int64_t wait_begin_ns, CallSiteStats *caller);
+
+    /// @note: dense index of the semaphore `sem_numid`, exits on an id
+    /// the set does not have
+    sem_nameid_t resolve(sem_nameid_t sem_numid) const;
+
+    /// @note: `request` with dense indices, in `scratch` unless the ids
+    /// are dense already
+    const sem_nameid_min_val_vec_t &resolve(
+      const sem_nameid_min_val_vec_t &request,
+      sem_nameid_min_val_vec_t &scratch) const;
+
+    /// @note: the threads backend behind wait, signal and adjust
+    bool thread_wait(const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+      CallSiteStats *caller);
+    int32_t thread_try(const sem_nameid_min_val_vec_t &request);
+    void thread_signal(sem_nameid_t sem_numid, int16_t sem_op);
+    int32_t thread_adjust(sem_nameid_t sem_numid, int16_t delta);
+    void wake_threads(sem_nameid_t sem_numid);
+
+    /// Swait, Ssignal, adjust_capacity and getVal on dense indices
+    bool wait(const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+      CallSite site);
+    void signal(sem_nameid_t sem_numid, int16_t sem_op);
+    int32_t adjust(sem_nameid_t sem_numid, int16_t delta);
+    int32_t value_of(sem_nameid_t sem_numid) const;
+
+    /// @note: `permits` held by `pid` on `sem_numid` changed, negative
+    /// on release. Feeds the wait-for graph, returns the slot of `pid`
+    /// while it still holds some
+    HolderSlot *note_holder(
+      sem_nameid_t sem_numid, int32_t permits, pid_t pid);
+
+    /// @note: the holder slot of `pid`, nullptr when it has none. For
+    /// this process the slot of last time is tried first, and no slot is
+    /// looked at while nobody holds the semaphore
+    HolderSlot *find_holder(sem_nameid_t sem_numid, pid_t pid);
+
+    /// @note: bookkeeping of one acquisition, park or release: holders,
+    /// stats, call sites and the trace ring
+    void note_acquired(sem_nameid_t sem_numid, int32_t permits,
+      int64_t wait_begin_ns, uint8_t outcome, CallSiteStats *caller);
+    void note_parked(sem_nameid_t sem_numid, CallSiteStats *caller);
+    void note_released(sem_nameid_t sem_numid, int32_t permits);
+
+    /// @note: the HolderSlot::site of `caller`. Formatted and interned in
+    /// the control block the first time this handle sees the site, a
+    /// lookup after that
+    int32_t site_of(const CallSiteStats *caller);
+    int32_t intern_site(const CallSiteStats *caller);
+
+    /// @note: warn about the holders past `long_hold_ns`, called by
+    /// parked processes. Warnings are rate limited across the set
+    void check_long_holds();
+    void warn_long_hold(
+      sem_nameid_t sem_numid, pid_t pid, const char *site, int64_t held_ns);
+    int32_t enter_waiters(sem_nameid_t blocked_on);
+    void leave_waiters(WaiterSlot &waiter);
+
+    /// @note: free the waiter slots of processes that died inside Swait,
+    /// hand-off mode requires the control block lock. Returns how many.
+    /// `dead` counts as dead even while it is still a zombie
+    int32_t reap_dead_waiters(pid_t dead = 0);
+    void abort_waiter(WaiterSlot &waiter);
+
+    /// @note: legacy mode, wake the processes parked on `sem_numid`
+    void wake_parked(sem_nameid_t sem_numid);
+
+    /// @note: give permits nobody holds an undo for back to the set,
+    /// a pending shrink swallows them first
+    void return_permits(sem_nameid_t sem_numid, int16_t permits);
+    void return_lease(LeaseSlot &lease);
+    void reclaim_expired_leases();
+
+    /// @note: the live lease `lease_id` of this process marked busy, or
+    /// nullptr once the slot was reclaimed or given to another lease
+    LeaseSlot *take_lease(lease_id_t lease_id);
+
+    /// @note: block on `op`, while leases are alive only until the first
+    /// of them expires so a parked process can give it back, and no
+    /// longer than `deadlock_check_ns` or `long_hold_ns`. False when it
+    /// timed out
+    bool park(int32_t on_semid, sembuf op);
+
+    /// a trace ring of config.trace_capacity events, none when 0
+    void map_trace_ring();
+
+    /// @note: map config.state_path as the control block. True when it
+    /// holds the state of this very set, `existed` when it was not new
+    bool map_state_file(bool &existed);
+    bool attach_state_file();
+
+    /// forget the holders, waiters and leases of a previous run
+    void reset_transient_state();
+
+    /// @note: every handle alive in this process is known to the fork
+    /// hooks, installed with pthread_atfork by the first one
+    void track_handle();
+    void untrack_handle();
+    static void atfork_prepare();
+    static void atfork_parent();
+    static void atfork_child();
+
+    /// @note: forget what this process took and from where, a forked
+    /// child holds nothing of what its parent held and removes nothing
+    void reset_process_state();
+
+    /// the handle behind clone_for_child(), shares every mapping
+    SemaphoreSet(const SemaphoreSet &other);
+
+    /// @note: the set the waiter slots park on. Outside hand-off mode it
+    /// is made by the first process that has to park, -1 while there is
+    /// none and `create` is false
+    int32_t park_semid_of(bool create);
+    void on_park_timeout(sem_nameid_t blocked_on);
+
     static void check_semctl_error() {
         spdlog::error("Error initializing semaphore in {} error {}", __LINE__,
           std::strerror(errno));
@@ -95,19 +361,113 @@ class SemaphoreSet {
     }
 
   public:
-    SemaphoreSet(key_t key, const sem_name_id_map_t &sem_names);
+    /// @note: a `key` whose set is still in use is refused, what an
+    /// earlier run left under it is removed and made anew
+    SemaphoreSet(key_t key, const sem_name_id_map_t &sem_names,
+      SemSetConfig config = {});
+
+    /// @note: ids may be sparse, `ids` has to hold exactly the ids of
+    /// `sem_names`. A StaticSemIdMap turns into a perfect hash here
+    SemaphoreSet(key_t key, const sem_name_id_map_t &sem_names, SemIdMap ids,
+      SemSetConfig config = {});
+
+    /// @note: join the set another process created under `key`, without
+    /// touching any value. Maps the control block and reads the kernel
+    /// sets, ids and mode from it, waiting until the creator is ready.
+    /// The trace ring of an attached process is its own
+    SemaphoreSet(attach_t, key_t key, SemSetConfig config = {});
+
+    SemaphoreSet &operator=(const SemaphoreSet &) = delete;
+
+    /// @note: another handle on the same set for a forked worker, without
+    /// any syscall: it shares the kernel sets, the control block and the
+    /// trace ring of this one and starts with nothing held. It must not
+    /// outlive this handle. The handles a process has when it forks are
+    /// reset in the child all the same
+    SemaphoreSet clone_for_child() const;
 
     /// {    sem_nameid  P,v op     min_val
     ///
     ///     {0,         { -1 ,       1 } }
     ///
     /// }
-    void Swait(const sem_nameid_min_val_vec_t &sem_op_min_val_vector);
+    /// @note: false only when it was picked as a deadlock victim, nothing
+    /// is acquired then
+    ///
+    /// @note: wait time, parks and hold time are added up per call site,
+    /// see call_site_report()
+    bool Swait(const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+      CallSite site = {});
 
     void Ssignal(sem_nameid_t sem_numid, int16_t sem_op = Vsemop);
 
+    /// @note: Swait whose permits expire `ttl_ns` after the last renewal.
+    /// The next Swait of any process gives back the permits of an expired
+    /// lease, or of one whose owner is gone
+    lease_id_t SwaitLease(const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+      int64_t ttl_ns, CallSite site = {});
+
+    /// push the expiry of a lease by its ttl, false once it was reclaimed
+    bool renewLease(lease_id_t lease);
+
+    /// give the permits of a lease back, false once it was reclaimed
+    bool SsignalLease(lease_id_t lease);
+
+    /// @note: change how many permits `sem_numid` hands out. The change
+    /// belongs to the set and not to the caller, so it is made without
+    /// SEM_UNDO. A shrink only takes the permits that are free right now,
+    /// returns the delta actually applied
+    int32_t adjust_capacity(sem_nameid_t sem_numid, int16_t delta);
+
+    /// @note: set the total capacity of `sem_numid` while it is in use.
+    /// Growing pays back pending shrinks first and wakes waiters, shrinking
+    /// takes the free permits now and swallows the rest as holders Ssignal.
+    /// `new_capacity` is 0 to kMaxSemValue, so the change fits one semop
+    void resize(sem_nameid_t sem_numid, int32_t new_capacity);
+
+    int32_t getCapacity(sem_nameid_t sem_numid) const;
+
+    /// @note: intern `name` for `sem_numid` in the control block, so
+    /// every process of the set can find the semaphore by it. A name is
+    /// set once, exits when it is taken or longer than kSemNameLen - 1
+    void setName(sem_nameid_t sem_numid, const std::string &name);
+
+    /// @note: the id named `name`, -1 when there is none. Hashes `name`
+    /// once, look the handle up at startup and pass it to Swait/Ssignal
+    int32_t lookupName(const std::string &name) const;
+
+    /// the name of `sem_numid`, empty when it has none
+    const char *getName(sem_nameid_t sem_numid) const;
+
+    /// @note: give back everything process `pid` left behind when it
+    /// died: its leases, its holder slots, its waiter slot and what was
+    /// reserved for it, then wake whoever can go now. Permits it held
+    /// with SEM_UNDO are back in the set already. Returns the permits it
+    /// held, see HolderReaper
+    int32_t reclaim_dead(pid_t pid);
+
+    /// @note: build the wait-for graph from the waiters and holders in the
+    /// control block and return its knots, waiters that only wait for each
+    /// other and are all short. With `break_cycles` the youngest waiter of
+    /// every knot gets its Swait failed
+    std::vector< deadlock_cycle_t > detect_deadlocks(bool break_cycles = false);
+
+    /// @note: write the events still in the trace ring to `path`, decode
+    /// them with the semset-trace tool
+    bool dump_trace(const char *path);
+
+    /// same events as Chrome trace-event JSON, see export_chrome_trace
+    bool dump_chrome_trace(const char *path);
+
     int32_t getSemid() const;
 
+    /// how long constructing or attaching took in this process
+    int64_t getConstructNs() const;
+
+    /// @note: the shared bookkeeping, every counter in it is an atomic
+    /// and can be read without any lock
+    const ControlBlock *getControlBlock() const;
+
     int32_t getVal(sem_nameid_t sem_numid) const;
     ~SemaphoreSet();
 };
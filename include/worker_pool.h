@@ -0,0 +1,116 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+constexpr int32_t kPoolJobArgs = 4;
+
+/// @note: one unit of work, copied into shared memory. What `kind` and
+/// `args` mean is up to the handler, negative kinds are the pool's own
+struct PoolJob {
+    int32_t kind;
+    int64_t args[kPoolJobArgs];
+};
+
+/// @note: a bounded queue of jobs in shared memory. free and queued
+/// count the cells of either kind in a kernel set of the pool, a cell is
+/// ready for the other side once its seq says so
+struct PoolQueue {
+    /// @note: a worker marks the cell it takes a job from with its index
+    /// in the seq, so the pool can free the cell if the worker dies
+    static constexpr uint64_t kTaken    = 1ull << 63;
+    static constexpr int32_t kTakerBits = 48;
+    static constexpr uint64_t kPosMask  = (1ull << kTakerBits) - 1;
+
+    std::atomic< uint64_t > head; // next cell to take a job from
+    std::atomic< uint64_t > tail; // next cell to put a job into
+    std::atomic< uint64_t > submitted;
+    std::atomic< uint64_t > completed;
+    int32_t capacity;
+    int32_t num_workers;
+
+    struct Cell {
+        /// pos when free, pos + 1 when queued, taken_seq() while taken
+        std::atomic< uint64_t > seq;
+        PoolJob job;
+    };
+
+    static uint64_t taken_seq(int32_t worker, uint64_t pos) {
+        return kTaken | ((uint64_t)worker << kTakerBits) | (pos + 1);
+    }
+
+    Cell *cells() { return (Cell *)(this + 1); }
+
+    /// @note: per worker, 1 from taking a job until it is counted done
+    std::atomic< int32_t > *busy() {
+        return (std::atomic< int32_t > *)(this->cells() + this->capacity);
+    }
+
+    static size_t size_for(int32_t capacity, int32_t num_workers) {
+        return sizeof(PoolQueue) + capacity * sizeof(Cell) +
+               num_workers * sizeof(std::atomic< int32_t >);
+    }
+};
+
+/// @note: forks `num_workers` processes up front, each with its own
+/// handle on the SemaphoreSet from clone_for_child(), and hands them jobs
+/// over a PoolQueue. A job costs two semops instead of a fork, which the
+/// handler sees together with the handle of its worker
+///
+/// @note: the handler runs in the workers, it is copied into them by the
+/// fork like anything else the creator had. A worker that dies, or whose
+/// handler throws, loses its job, which then counts as completed. The
+/// creator notices in drain(), or while a submit waits for its cell, and
+/// starts another worker in its place
+class WorkerPool {
+  public:
+    using handler_t = std::function< void(const PoolJob &, SemaphoreSet &) >;
+
+  private:
+    SemaphoreSet &sem_set;
+    handler_t handler;
+    PoolQueue *queue = nullptr;
+    int32_t semid    = -1; // free cells, queued jobs, drained
+    pid_t owner;           // the only process that may stop the pool
+    std::vector< pid_t > workers;
+    bool stopped = false;
+
+    pid_t spawn(int32_t index);
+    [[noreturn]] void work(int32_t index);
+    bool push(const PoolJob &job);
+
+    /// @note: the creator only, free the cell and count the job of every
+    /// worker that exited and start another one unless stopped. Returns
+    /// how many exited
+    int32_t reap_workers();
+
+  public:
+    WorkerPool(SemaphoreSet &sem_set, int32_t num_workers, handler_t handler,
+      int32_t queue_capacity = 1024);
+
+    /// @note: queue `job` for the next free worker, blocks while the
+    /// queue is full. False once the pool is stopped
+    bool submit(const PoolJob &job);
+
+    /// @note: block until every job submitted so far is done
+    void drain();
+
+    /// @note: let the workers finish what is queued, then wait for them
+    /// to exit. Called by the destructor in the creator
+    void stop();
+
+    int32_t size() const;
+    uint64_t getCompleted() const;
+
+    ~WorkerPool();
+};
+
+} // namespace lap
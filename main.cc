@@ -1,122 +1,335 @@
 #include <spdlog/cfg/env.h>
 #include <spdlog/spdlog.h>
+#include <sys/mman.h>
 #include <sys/sem.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
-#include <fstream>
 #include <random>
+#include <vector>
 
+#include "sem_clock.h"
+#include "sem_stats.h"
 #include "semaphore_set.h"
+#include "worker_pool.h"
 
-/// max reader numbers
-constexpr int16_t MAX_READERS = 3;
-constexpr int16_t MAX_WRITERS = 1;
+/// what the operations of one role did, summed over every worker
+struct RoleStats {
+    std::atomic< uint64_t > ops;
+    std::atomic< int64_t > max_wait_ns;
+    lap::LatencyHistogram wait_ns; /// Swait entry to inside the section
+    lap::LatencyHistogram op_ns;   /// Swait entry to after the Ssignal
+};
+
+/// shared by the driver and every worker process
+struct DriverStats {
+    std::atomic< bool > stopping;
+    std::atomic< int32_t > readers_in; /// inside a section right now
+    std::atomic< int32_t > writers_in;
+    std::atomic< uint64_t > violations; /// the sections overlapped wrongly
+    RoleStats read;
+    RoleStats write;
+};
+
+struct DriverOptions {
+    int32_t readers     = 3;   /// processes that only read
+    int32_t writers     = 5;   /// processes that only write
+    int32_t mixed       = 0;   /// processes that pick per operation
+    double read_ratio   = 0.8; /// share of reads of a mixed process
+    int16_t max_readers = 3;   /// readers allowed in at the same time
+    double seconds      = 5;
+    int64_t think_ns    = 100000; /// outside a section between two ops
+    int64_t section_ns  = 20000;  /// inside a section, busy
+    bool handoff        = false;
+    bool pool           = false; /// hand every op to a WorkerPool
+};
 
 class ReaderWriterProblem {
   private:
-    void write_to(const char* file_name) {
-        std::srand(std::time(nullptr));
-        std::fstream fs(file_name, std::ios::out);
-        auto val = std::rand();
-        spdlog::info("╰─ I Write this: Hello World {}", val);
-        fs << "Hello World " << val << std::endl;
+    /// @note: spin instead of sleeping, a section of a few us would
+    /// otherwise last as long as the timer slack
+    static void busy_for(int64_t ns) {
+        int64_t end_ns = lap::monotonic_ns() + ns;
+        while (lap::monotonic_ns() < end_ns) {
+        }
     }
 
-    void read_from(const char* file_name, int32_t id) {
-        std::fstream fs(file_name, std::ios::in);
-        std::string line;
-        while (std::getline(fs, line)) {
-            spdlog::info("Reader id: {} I Read this: {}", id, line);
+    static void record(RoleStats &role, int64_t begin_ns, int64_t entered_ns) {
+        int64_t wait_ns = entered_ns - begin_ns;
+        role.ops.fetch_add(1, std::memory_order_relaxed);
+        role.wait_ns.record(wait_ns);
+        role.op_ns.record(lap::monotonic_ns() - begin_ns);
+        int64_t max_wait_ns = role.max_wait_ns.load();
+        while (wait_ns > max_wait_ns &&
+               !role.max_wait_ns.compare_exchange_weak(max_wait_ns, wait_ns))
+        {
         }
     }
 
   private:
     lap::SemaphoreSet semSet;
+    int16_t max_readers;
+    DriverStats *stats;
 
     enum SemaphoreNames { READ_LEFT = 0, RW_MUTEX, WAIT };
 
   public:
-    ReaderWriterProblem()
-        : semSet{
-            IPC_PRIVATE,
-            {{READ_LEFT, MAX_READERS}, {RW_MUTEX, 1}, {WAIT, 1}}
-    } {}
+    ReaderWriterProblem(
+      int16_t max_readers, lap::SemSetConfig config, DriverStats *stats)
+        : semSet{IPC_PRIVATE,
+            {{READ_LEFT, max_readers}, {RW_MUTEX, 1}, {WAIT, 1}}, config},
+          max_readers(max_readers), stats(stats) {}
 
     /**
      * @brief: when Swait's sem value >= specify min resources value, distribute
      * resources and continue;
      * when Swait's sem value < specify min resources value, block itself
      */
-    void reader(int32_t id) {
+    void reader(int64_t section_ns) {
+        int64_t begin_ns = lap::monotonic_ns();
         semSet.Swait({
           {READ_LEFT, {1, -1}},
           {WAIT,      {1, 0} },
           {RW_MUTEX,  {1, 0} },
         });
+        int64_t entered_ns = lap::monotonic_ns();
 
         // Reading
-        spdlog::info("Reader id:{} Readers left:{} Write Mutex:{}"
-                     " Reader Mutex:{}",
-          id, semSet.getVal(READ_LEFT), semSet.getVal(WAIT),
-          semSet.getVal(RW_MUTEX));
-        read_from("file.txt", id);
+        int32_t readers_in = ++stats->readers_in;
+        if (readers_in > max_readers || stats->writers_in.load() != 0) {
+            ++stats->violations;
+        }
+        busy_for(section_ns);
+        --stats->readers_in;
 
         semSet.Ssignal(READ_LEFT);
+        record(stats->read, begin_ns, entered_ns);
     }
 
-    void writer(int32_t id) {
+    void writer(int64_t section_ns) {
+        int64_t begin_ns = lap::monotonic_ns();
         semSet.Swait({
           {WAIT, {1, -1}},
         });
         semSet.Swait({
-          {RW_MUTEX,  {1, -1}},
-          {READ_LEFT, {3, 0} }
+          {RW_MUTEX,  {1, -1}         },
+          {READ_LEFT, {max_readers, 0}}
         });
+        int64_t entered_ns = lap::monotonic_ns();
 
         // Writing
-        spdlog::info("╭─ Writer id:{} Readers left:{} Write Mutex:{} Reader "
-                     "Mutex:{}",
-          id, semSet.getVal(READ_LEFT), semSet.getVal(RW_MUTEX),
-          semSet.getVal(WAIT));
-        write_to("file.txt");
+        int32_t writers_in = ++stats->writers_in;
+        if (writers_in != 1 || stats->readers_in.load() != 0) {
+            ++stats->violations;
+        }
+        busy_for(section_ns);
+        --stats->writers_in;
 
         semSet.Ssignal(WAIT);
         semSet.Ssignal(RW_MUTEX);
+        record(stats->write, begin_ns, entered_ns);
     }
+
+    lap::SemaphoreSet &getSemSet() { return semSet; }
 };
 
-int main() {
+enum class Role { READER, WRITER, MIXED };
+
+[[noreturn]] void run_worker(ReaderWriterProblem &rwp, DriverStats *stats,
+  const DriverOptions &options, Role role) {
+    std::minstd_rand rng(getpid());
+    std::bernoulli_distribution pick_read(options.read_ratio);
+    timespec think = {options.think_ns / 1000000000LL,
+      options.think_ns % 1000000000LL};
+    while (!stats->stopping.load()) {
+        if (options.think_ns > 0) {
+            nanosleep(&think, nullptr);
+        }
+        bool read = role == Role::READER ||
+                    (role == Role::MIXED && pick_read(rng));
+        if (read) {
+            rwp.reader(options.section_ns);
+        }
+        else {
+            rwp.writer(options.section_ns);
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+enum JobKind { READ_JOB, WRITE_JOB };
+
+/// @note: the same ops from a pool of as many workers, the driver picks
+/// each one and queues it until the time is up
+void run_pool(ReaderWriterProblem &rwp, DriverStats *stats,
+  const DriverOptions &options, int32_t num_workers) {
+    timespec think = {options.think_ns / 1000000000LL,
+      options.think_ns % 1000000000LL};
+    lap::WorkerPool pool(rwp.getSemSet(), num_workers,
+      [&](const lap::PoolJob &job, lap::SemaphoreSet &) {
+          if (options.think_ns > 0) {
+              nanosleep(&think, nullptr);
+          }
+          if (job.kind == READ_JOB) {
+              rwp.reader(options.section_ns);
+          }
+          else {
+              rwp.writer(options.section_ns);
+          }
+      });
+
+    std::minstd_rand rng(getpid());
+    std::bernoulli_distribution pick_read(
+      (options.readers + options.mixed * options.read_ratio) / num_workers);
+    int64_t end_ns = lap::monotonic_ns() + (int64_t)(options.seconds * 1e9);
+    while (lap::monotonic_ns() < end_ns) {
+        pool.submit({pick_read(rng) ? READ_JOB : WRITE_JOB, {}});
+    }
+    stats->stopping.store(true);
+    pool.stop();
+}
+
+void print_role(const char *name, const RoleStats &role, double seconds) {
+    uint64_t wait[lap::kHistBuckets], op[lap::kHistBuckets];
+    role.wait_ns.load(wait);
+    role.op_ns.load(op);
+    int64_t max_wait_ns = role.max_wait_ns.load();
+    std::printf("%-6s %10lu %10.0f %10s %10s %10s %10s %10s\n", name,
+      (unsigned long)role.ops.load(), role.ops.load() / seconds,
+      lap::format_ns(std::min(lap::hist_percentile(wait, 0.5), max_wait_ns))
+        .c_str(),
+      lap::format_ns(std::min(lap::hist_percentile(wait, 0.99), max_wait_ns))
+        .c_str(),
+      lap::format_ns(max_wait_ns).c_str(),
+      lap::format_ns(lap::hist_percentile(op, 0.5)).c_str(),
+      lap::format_ns(lap::hist_percentile(op, 0.99)).c_str());
+}
+
+/// run the reader/writer problem under sustained load
+///
+///     SemaphoreSet [-r readers] [-w writers] [-m mixed] [-R read_ratio]
+///                  [-k max_readers] [-d seconds] [-t think_us]
+///                  [-c section_us] [-H] [-P]
+///
+/// @note: every worker loops until the time is up, then the throughput
+/// and the latency of reads and writes are printed. Exits with 1 when
+/// the sections ever overlapped wrongly. With -P as many workers of a
+/// WorkerPool get every op handed to them, the wait does not count the
+/// time in the queue
+int main(int argc, char **argv) {
     spdlog::set_pattern("[%^--%l--%$] [Process %P] %v");
     spdlog::cfg::load_env_levels();
-    ReaderWriterProblem rwp;
 
-    std::array< int32_t, 8 > fork_seq = {0, 1, 2, 3, 4, 5, 6, 7};
-    std::shuffle(
-      fork_seq.begin(), fork_seq.end(), std::mt19937(std::random_device()()));
+    DriverOptions options;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:m:R:k:d:t:c:HP")) != -1) {
+        switch (opt) {
+            case 'r':
+                options.readers = std::atoi(optarg);
+                break;
+            case 'w':
+                options.writers = std::atoi(optarg);
+                break;
+            case 'm':
+                options.mixed = std::atoi(optarg);
+                break;
+            case 'R':
+                options.read_ratio = std::atof(optarg);
+                break;
+            case 'k':
+                options.max_readers = (int16_t)std::atoi(optarg);
+                break;
+            case 'd':
+                options.seconds = std::atof(optarg);
+                break;
+            case 't':
+                options.think_ns = std::atoll(optarg) * 1000;
+                break;
+            case 'c':
+                options.section_ns = std::atoll(optarg) * 1000;
+                break;
+            case 'H':
+                options.handoff = true;
+                break;
+            case 'P':
+                options.pool = true;
+                break;
+            default:
+                std::fprintf(stderr,
+                  "usage: %s [-r readers] [-w writers] [-m mixed] "
+                  "[-R read_ratio] [-k max_readers] [-d seconds] "
+                  "[-t think_us] [-c section_us] [-H] [-P]\n",
+                  argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (options.max_readers < 1 || options.read_ratio < 0 ||
+        options.read_ratio > 1)
+    {
+        spdlog::error("max_readers must be positive and read_ratio in [0, 1]");
+        return EXIT_FAILURE;
+    }
+
+    auto *stats = (DriverStats *)mmap(nullptr, sizeof(DriverStats),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        spdlog::error("Error mapping driver stats in {}", __LINE__);
+        return EXIT_FAILURE;
+    }
 
-    // fork 5 writers and 3 readers
-    for (int32_t id : fork_seq) {
-        if (id < 4) {
-            if (fork() == 0) {
-                rwp.writer(id);
+    lap::SemSetConfig config;
+    config.handoff = options.handoff;
+    ReaderWriterProblem rwp(options.max_readers, config, stats);
+
+    std::vector< Role > roles;
+    roles.insert(roles.end(), options.readers, Role::READER);
+    roles.insert(roles.end(), options.writers, Role::WRITER);
+    roles.insert(roles.end(), options.mixed, Role::MIXED);
+
+    int64_t begin_ns = lap::monotonic_ns();
+    if (options.pool) {
+        run_pool(rwp, stats, options, roles.size());
+    }
+    else {
+        std::vector< pid_t > workers;
+        for (Role role : roles) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                run_worker(rwp, stats, options, role);
+            }
+            if (pid == -1) {
+                spdlog::error("Error forking worker in {}", __LINE__);
+                stats->stopping.store(true);
                 break;
             }
+            workers.push_back(pid);
         }
-        else if (id == 4) {
-            rwp.writer(id);
+
+        int64_t duration_ns = (int64_t)(options.seconds * 1e9);
+        timespec duration   = {duration_ns / 1000000000LL,
+            duration_ns % 1000000000LL};
+        while (nanosleep(&duration, &duration) == -1 && errno == EINTR) {
         }
-        else {
-            if (fork() == 0) {
-                rwp.reader(id);
-                break;
-            }
+        stats->stopping.store(true);
+        for (pid_t pid : workers) {
+            waitpid(pid, nullptr, 0);
         }
     }
+    double seconds = (lap::monotonic_ns() - begin_ns) / 1e9;
+
+    std::printf("%-6s %10s %10s %10s %10s %10s %10s %10s\n", "role", "ops",
+      "ops/s", "wait p50", "wait p99", "wait max", "op p50", "op p99");
+    print_role("read", stats->read, seconds);
+    print_role("write", stats->write, seconds);
+    std::printf("%d readers, %d writers, %d mixed in %.1fs, %lu overlaps\n",
+      options.readers, options.writers, options.mixed, seconds,
+      (unsigned long)stats->violations.load());
 
-    return EXIT_SUCCESS;
+    return stats->violations.load() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,123 @@
+#include "adaptive_limit.h"
+
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "sem_clock.h"
+
+namespace lap {
+
+AdaptiveLimit::AdaptiveLimit(
+  SemaphoreSet &sem_set, sem_nameid_t sem_numid, AimdConfig config)
+    : sem_set(sem_set), sem_numid(sem_numid), config(config) {
+    if (config.min_limit < 1 || config.initial_limit < config.min_limit ||
+        config.max_limit < config.initial_limit || config.window < 1 ||
+        config.backoff <= 0 || config.backoff >= 1)
+    {
+        spdlog::error("Invalid AIMD config for sem {}", sem_numid);
+        exit(1);
+    }
+    if (config.initial_limit > sem_set.getCapacity(sem_numid)) {
+        spdlog::error("AIMD initial limit {} of sem {} is above its "
+                      "capacity {}",
+          config.initial_limit, sem_numid, sem_set.getCapacity(sem_numid));
+        exit(1);
+    }
+
+    void *mem = mmap(nullptr, sizeof(State), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        spdlog::error("Error mapping AIMD state in {}", __LINE__);
+        exit(1);
+    }
+    this->state = new (mem) State{};
+    this->state->limit.store(config.initial_limit);
+
+    /// @note: start the semaphore at the limit getLimit reports, it was
+    /// created at its full capacity
+    this->sem_set.resize(this->sem_numid, config.initial_limit);
+}
+
+int64_t AdaptiveLimit::acquire(CallSite site) {
+    sem_nameid_min_val_vec_t one_permit = {
+      {this->sem_numid, {1, -1}}
+    };
+    this->sem_set.Swait(one_permit, site);
+    return monotonic_ns();
+}
+
+void AdaptiveLimit::release(int64_t acquired_ns) {
+    this->sem_set.Ssignal(this->sem_numid);
+    this->record(monotonic_ns() - acquired_ns);
+}
+
+void AdaptiveLimit::record(int64_t hold_ns) {
+    this->state->sum_hold_ns.fetch_add(hold_ns);
+
+    /// @note: only the process closing the window adjusts, the others
+    /// just leave their sample behind. Closing takes every sample counted
+    /// so far in the same CAS, so a sample that comes meanwhile counts for
+    /// the next window and is never lost
+    int32_t samples = this->state->samples.load();
+    int32_t counted;
+    while (true) {
+        counted     = samples + 1;
+        bool closes = counted >= this->config.window;
+        if (this->state->samples.compare_exchange_weak(
+              samples, closes ? 0 : counted))
+        {
+            if (!closes) {
+                return;
+            }
+            break;
+        }
+    }
+    int64_t sum_hold_ns = this->state->sum_hold_ns.exchange(0);
+    if (!this->adjust(sum_hold_ns / counted)) {
+        /// @note: another process is still adjusting, hand the samples
+        /// back so the next window closes on them as well
+        this->state->sum_hold_ns.fetch_add(sum_hold_ns);
+        this->state->samples.fetch_add(counted);
+    }
+}
+
+bool AdaptiveLimit::adjust(int64_t mean_hold_ns) {
+    if (this->state->adjusting.test_and_set()) {
+        return false;
+    }
+
+    int32_t limit = this->state->limit.load();
+    if (mean_hold_ns <= this->config.target_hold_ns) {
+        limit = std::min(
+          limit + this->config.additive_step, this->config.max_limit);
+    }
+    else {
+        limit = std::max(
+          (int32_t)(limit * this->config.backoff), this->config.min_limit);
+    }
+    this->state->limit.store(limit);
+
+    /// @note: a shrink below what is held right now completes as the
+    /// holders Ssignal, see SemaphoreSet::resize
+    this->sem_set.resize(this->sem_numid, limit);
+
+    spdlog::debug("AIMD sem {} mean hold {}ns limit {}", this->sem_numid,
+      mean_hold_ns, limit);
+    this->state->adjusting.clear();
+    return true;
+}
+
+int32_t AdaptiveLimit::getLimit() const { return this->state->limit.load(); }
+
+AdaptiveLimit::~AdaptiveLimit() {
+    if (this->state != nullptr) {
+        munmap(this->state, sizeof(State));
+    }
+}
+
+} // namespace lap
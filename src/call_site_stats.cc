@@ -0,0 +1,144 @@
+#include "call_site_stats.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace lap {
+
+namespace {
+
+/// @note: a forked child starts with the sites of its parent, counted
+/// from zero again by the fork hooks of SemaphoreSet
+CallSiteStats call_sites[kMaxCallSites];
+CallSiteStats other_sites = {
+  {2}, "<other>", 0, "", {}, {}, {}, {}, {}, {}, {}};
+
+void store_max(std::atomic< uint64_t > &max, uint64_t value) {
+    uint64_t cur = max.load(std::memory_order_relaxed);
+    while (cur < value &&
+           !max.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+CallSiteReport report_of(const CallSiteStats &stats) {
+    return {stats.file, stats.line, stats.function,
+      stats.waits.load(std::memory_order_relaxed),
+      stats.parks.load(std::memory_order_relaxed),
+      stats.wait_ns.load(std::memory_order_relaxed),
+      stats.max_wait_ns.load(std::memory_order_relaxed),
+      stats.holds.load(std::memory_order_relaxed),
+      stats.hold_ns.load(std::memory_order_relaxed),
+      stats.max_hold_ns.load(std::memory_order_relaxed)};
+}
+
+} // namespace
+
+void CallSiteStats::record_wait(int64_t ns) {
+    this->waits.fetch_add(1, std::memory_order_relaxed);
+    if (ns != 0) {
+        this->wait_ns.fetch_add(ns, std::memory_order_relaxed);
+        store_max(this->max_wait_ns, ns);
+    }
+}
+
+void CallSiteStats::record_hold(int64_t ns) {
+    this->holds.fetch_add(1, std::memory_order_relaxed);
+    this->hold_ns.fetch_add(ns, std::memory_order_relaxed);
+    store_max(this->max_hold_ns, ns);
+}
+
+/// @note: open addressing with linear probing, slots are never freed so
+/// a probe stops at the first free one
+CallSiteStats *call_site_stats(const CallSite &site) {
+    uint64_t hash = ((uintptr_t)site.file ^ site.line) * 0x9e3779b97f4a7c15ULL;
+    for (uint32_t probe = 0; probe < kMaxCallSites; ++probe) {
+        CallSiteStats &stats =
+          call_sites[((hash >> 40) + probe) & (kMaxCallSites - 1)];
+        uint32_t state = stats.state.load(std::memory_order_acquire);
+        if (state == 0) {
+            if (stats.state.compare_exchange_strong(state, 1)) {
+                stats.file     = site.file;
+                stats.line     = site.line;
+                stats.function = site.function;
+                stats.state.store(2, std::memory_order_release);
+                return &stats;
+            }
+        }
+        while (state == 1) {
+            state = stats.state.load(std::memory_order_acquire);
+        }
+        if (stats.file == site.file && stats.line == site.line) {
+            return &stats;
+        }
+    }
+    return &other_sites;
+}
+
+uint32_t call_site_index(const CallSiteStats *stats) {
+    return stats == &other_sites ? kMaxCallSites : stats - call_sites;
+}
+
+std::vector< CallSiteReport > call_site_report() {
+    std::vector< CallSiteReport > report;
+    for (auto &stats : call_sites) {
+        if (stats.state.load(std::memory_order_acquire) == 2) {
+            report.push_back(report_of(stats));
+        }
+    }
+    if (other_sites.waits.load() > 0) {
+        report.push_back(report_of(other_sites));
+    }
+    std::sort(report.begin(), report.end(),
+      [](const CallSiteReport &a, const CallSiteReport &b) {
+          return a.wait_ns > b.wait_ns;
+      });
+    return report;
+}
+
+/// @note: only the counters, the sites keep their slots
+void reset_call_site_stats() {
+    auto reset = [](CallSiteStats &stats) {
+        for (auto *counter : {&stats.waits, &stats.parks, &stats.wait_ns,
+               &stats.max_wait_ns, &stats.holds, &stats.hold_ns,
+               &stats.max_hold_ns})
+        {
+            counter->store(0, std::memory_order_relaxed);
+        }
+    };
+    for (auto &stats : call_sites) {
+        reset(stats);
+    }
+    reset(other_sites);
+}
+
+void write_call_site_report(std::FILE *fp) {
+    std::fprintf(fp, "%8s %8s %12s %12s %8s %12s %12s  %s\n", "waits",
+      "parks", "wait ns", "max wait", "holds", "hold ns", "max hold",
+      "call site");
+    for (auto &site : call_site_report()) {
+        std::fprintf(fp,
+          "%8lu %8lu %12lu %12lu %8lu %12lu %12lu  %s:%u %s\n",
+          (unsigned long)site.waits, (unsigned long)site.parks,
+          (unsigned long)site.wait_ns, (unsigned long)site.max_wait_ns,
+          (unsigned long)site.holds, (unsigned long)site.hold_ns,
+          (unsigned long)site.max_hold_ns, site.file, site.line,
+          site.function);
+    }
+}
+
+bool dump_call_sites(const char *path) {
+    FILE *fp = std::fopen(path, "w");
+    if (fp == nullptr) {
+        spdlog::error("Error opening call site report {}", path);
+        return false;
+    }
+    write_call_site_report(fp);
+    return std::fclose(fp) == 0;
+}
+
+} // namespace lap
@@ -0,0 +1,184 @@
+#include <spdlog/spdlog.h>
+#include <sys/sem.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+/// @note: wake a parked process and make its Swait return false. In
+/// hand-off mode it must not have been granted anything yet
+void SemaphoreSet::abort_waiter(WaiterSlot &waiter) {
+    sembuf wake = {(unsigned short)(&waiter - this->ctrl->waiters), Vsemop, 0};
+    if (this->config.handoff) {
+        this->mantain_atomic(Psemop);
+        if (waiter.pid == 0 || waiter.granted || waiter.aborted) {
+            this->mantain_atomic(Vsemop);
+            return;
+        }
+        waiter.aborted.store(1);
+        semop(this->park_semid, &wake, 1);
+        this->mantain_atomic(Vsemop);
+        return;
+    }
+
+    /// @note: nobody else parks on the semaphore of its slot, a victim
+    /// that has not parked yet takes the token when it does
+    int32_t expected   = 0;
+    int32_t park_semid = this->park_semid_of(false);
+    if (waiter.aborted.compare_exchange_strong(expected, 1) &&
+        park_semid != -1)
+    {
+        semop(park_semid, &wake, 1);
+    }
+}
+
+std::vector< deadlock_cycle_t > SemaphoreSet::detect_deadlocks(
+  bool break_cycles) {
+    /// @note: waiter pid -> pids holding the semaphore it is parked on
+    std::unordered_map< pid_t, std::vector< pid_t > > wait_for;
+    std::unordered_map< pid_t, WaiterSlot * > parked;
+    std::unordered_map< pid_t, int32_t > blocked_on;
+    for (auto &waiter : this->ctrl->waiters) {
+        pid_t pid = waiter.pid.load();
+        if (pid == 0 || waiter.granted || waiter.aborted) {
+            continue;
+        }
+        parked[pid]     = &waiter;
+        blocked_on[pid] = waiter.blocked_on.load();
+        for (auto &holder : this->ctrl->sems()[blocked_on[pid]].holders) {
+            pid_t holder_pid = holder.pid.load();
+            if (holder_pid != 0 && holder_pid != pid) {
+                wait_for[pid].push_back(holder_pid);
+            }
+        }
+    }
+
+    /// @note: a cycle alone is no deadlock, a holder outside of it may
+    /// still give permits back. Only a group whose every waiter is short
+    /// and waits on nobody but the others of the group is stuck for good
+    auto is_knot = [&](const deadlock_cycle_t &group) {
+        if (group.size() < 2) {
+            return false;
+        }
+        for (pid_t pid : group) {
+            for (pid_t to : wait_for[pid]) {
+                if (std::find(group.begin(), group.end(), to) == group.end()) {
+                    return false;
+                }
+            }
+            const WaiterSlot &waiter = *parked[pid];
+            int32_t sem_numid        = blocked_on[pid];
+            const SemSlot &sem       = this->ctrl->sems()[sem_numid];
+            int32_t needed           = 1;
+            for (int32_t i = 0; i < waiter.num_ops; ++i) {
+                if (waiter.ops[i].sem_numid == sem_numid) {
+                    needed = needed_value(
+                      waiter.ops[i].min_val, waiter.ops[i].sem_op);
+                }
+            }
+            /// @note: with every holder slot taken some holders are missing
+            if (sem.num_holders.load() >= kMaxHolders ||
+                this->value_of(sem_numid) - sem.reserved >= needed)
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    /// @note: iterative Tarjan, the knots are among the strongly connected
+    /// components of waiters
+    std::unordered_map< pid_t, int32_t > order, low;
+    std::unordered_map< pid_t, bool > on_path;
+    std::vector< pid_t > path;
+    std::vector< deadlock_cycle_t > knots;
+    int32_t next_order = 0;
+
+    for (auto &[start, _] : parked) {
+        if (order.count(start) != 0) {
+            continue;
+        }
+        std::vector< std::pair< pid_t, size_t > > stack = {
+          {start, 0}
+        };
+        order[start] = low[start] = next_order++;
+        path.push_back(start);
+        on_path[start] = true;
+
+        while (!stack.empty()) {
+            auto &[pid, next_edge]     = stack.back();
+            std::vector< pid_t > &edges = wait_for[pid];
+            if (next_edge < edges.size()) {
+                pid_t to = edges[next_edge++];
+                if (parked.count(to) == 0) {
+                    continue; // a holder that is not waiting
+                }
+                if (order.count(to) == 0) {
+                    order[to] = low[to] = next_order++;
+                    path.push_back(to);
+                    on_path[to] = true;
+                    stack.push_back({to, 0});
+                }
+                else if (on_path[to]) {
+                    low[pid] = std::min(low[pid], order[to]);
+                }
+                continue;
+            }
+
+            pid_t done = pid;
+            stack.pop_back();
+            if (!stack.empty()) {
+                pid_t parent = stack.back().first;
+                low[parent]  = std::min(low[parent], low[done]);
+            }
+            if (low[done] != order[done]) {
+                continue;
+            }
+            deadlock_cycle_t group;
+            pid_t member;
+            do {
+                member = path.back();
+                path.pop_back();
+                on_path[member] = false;
+                group.push_back(member);
+            } while (member != done);
+            if (is_knot(group)) {
+                knots.push_back(std::move(group));
+            }
+        }
+    }
+
+    for (auto &knot : knots) {
+        std::string pids;
+        for (pid_t pid : knot) {
+            pids += (pids.empty() ? "" : ", ") + std::to_string(pid);
+        }
+        spdlog::warn("Deadlock between processes {}", pids);
+
+        if (!break_cycles) {
+            continue;
+        }
+
+        /// @note: the youngest waiter has the least work to lose
+        WaiterSlot *victim = nullptr;
+        for (pid_t pid : knot) {
+            WaiterSlot *waiter = parked[pid];
+            if (victim == nullptr || waiter->ticket > victim->ticket) {
+                victim = waiter;
+            }
+        }
+        spdlog::warn("Fail the Swait of process {} to break the deadlock",
+          victim->pid.load());
+        this->abort_waiter(*victim);
+    }
+    return knots;
+}
+
+} // namespace lap
@@ -0,0 +1,26 @@
+#include "fault_injection.h"
+
+namespace lap {
+
+const char *fault_point_name(FaultPoint point) {
+    switch (point) {
+        case FAULT_WAIT_BLOCKED:
+            return "wait-blocked";
+        case FAULT_WAIT_WOKEN:
+            return "wait-woken";
+        case FAULT_WAIT_ACQUIRED:
+            return "wait-acquired";
+        case FAULT_SIGNAL:
+            return "signal";
+        case FAULT_LOCKED:
+            return "locked";
+        case FAULT_WAIT_SHORT:
+            return "wait-short";
+        case FAULT_SIGNAL_RELEASED:
+            return "released";
+        default:
+            return "unknown";
+    }
+}
+
+} // namespace lap
@@ -0,0 +1,195 @@
+#include "holder_reaper.h"
+
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace lap {
+
+namespace {
+
+constexpr int32_t kScanMs = 10; // how soon a new process gets watched
+
+/// @note: through syscall, older C libraries have no wrapper for it
+int32_t pidfd_open(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/// every process the control block knows of, but us
+std::unordered_set< pid_t > tracked_pids(const ControlBlock *ctrl) {
+    std::unordered_set< pid_t > pids;
+    for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+        for (auto &holder : ctrl->sems()[i].holders) {
+            pids.insert(holder.pid.load(std::memory_order_relaxed));
+        }
+    }
+    for (auto &waiter : ctrl->waiters) {
+        pids.insert(waiter.pid.load(std::memory_order_relaxed));
+    }
+    for (auto &lease : ctrl->leases) {
+        if (lease_state(lease.state.load(std::memory_order_relaxed)) ==
+            LEASE_ACTIVE)
+        {
+            pids.insert(lease.owner);
+        }
+    }
+    pids.erase(0);
+    pids.erase(getpid());
+    return pids;
+}
+
+} // namespace
+
+int32_t SemaphoreSet::reclaim_dead(pid_t pid) {
+    int32_t permits = 0;
+
+    /// @note: leases first, giving one back also drops its share of the
+    /// holder slots
+    for (auto &lease : this->ctrl->leases) {
+        uint64_t word = lease.state.load();
+        if (lease_state(word) != LEASE_ACTIVE || lease.owner != pid ||
+            !lease.state.compare_exchange_strong(
+              word, lease_word(lease_generation(word), LEASE_BUSY)))
+        {
+            continue;
+        }
+        for (int32_t i = 0; i < lease.num_ops; ++i) {
+            this->trace(TRACE_RECLAIM, lease.ops[i].sem_numid,
+              -lease.ops[i].sem_op);
+            permits += std::max(0, -(int32_t)lease.ops[i].sem_op);
+        }
+        this->return_lease(lease);
+    }
+
+    /// @note: what is left was taken with SEM_UNDO, the kernel gave it
+    /// back when the process exited
+    std::vector< sem_nameid_t > released;
+    for (int32_t i = 0; i < num_sems; ++i) {
+        for (auto &holder : this->ctrl->sems()[i].holders) {
+            pid_t holder_pid = pid;
+            if (holder.pid.load() != pid) {
+                continue;
+            }
+            int32_t count = holder.count.exchange(0);
+            holder.since_ns.store(0);
+            if (holder.pid.compare_exchange_strong(holder_pid, 0)) {
+                this->ctrl->sems()[i].num_holders.fetch_sub(1);
+            }
+            this->trace(TRACE_RECLAIM, i, count);
+            permits += count;
+            released.push_back(i);
+        }
+    }
+
+    if (this->config.handoff) {
+        this->mantain_atomic(Psemop);
+        this->reap_dead_waiters(pid);
+        this->grant_waiters();
+        this->mantain_atomic(Vsemop);
+    }
+    else {
+        this->reap_dead_waiters(pid);
+        for (sem_nameid_t sem_numid : released) {
+            this->wake_parked(sem_numid);
+        }
+    }
+    if (permits > 0) {
+        spdlog::warn("Reclaimed {} permits of dead process {}", permits, pid);
+    }
+    return permits;
+}
+
+HolderReaper::HolderReaper(SemaphoreSet &sem_set)
+    : sem_set(sem_set), owner(getpid()) {
+    this->reaper = std::make_unique< std::thread >([this] { this->run(); });
+}
+
+void HolderReaper::run() {
+    std::unordered_map< pid_t, int32_t > pidfds;
+    std::unordered_set< pid_t > gone; // reclaimed, still in some slot
+    std::vector< pollfd > fds;
+    std::vector< pid_t > pids;
+    std::vector< pid_t > dead;
+
+    while (!this->stopping.load()) {
+        std::unordered_set< pid_t > tracked =
+          tracked_pids(this->sem_set.getControlBlock());
+        for (auto it = pidfds.begin(); it != pidfds.end();) {
+            if (tracked.count(it->first) == 0) {
+                close(it->second);
+                it = pidfds.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        for (auto it = gone.begin(); it != gone.end();) {
+            it = tracked.count(*it) == 0 ? gone.erase(it) : std::next(it);
+        }
+
+        /// @note: a process already gone by now has no pidfd to wait on
+        dead.clear();
+        for (pid_t pid : tracked) {
+            if (pidfds.count(pid) != 0 || gone.count(pid) != 0) {
+                continue;
+            }
+            int32_t pidfd = pidfd_open(pid);
+            if (pidfd != -1) {
+                pidfds[pid] = pidfd;
+            }
+            else if (errno == ESRCH) {
+                dead.push_back(pid);
+            }
+        }
+
+        fds.clear();
+        pids.clear();
+        for (auto &[pid, pidfd] : pidfds) {
+            fds.push_back({pidfd, POLLIN, 0});
+            pids.push_back(pid);
+        }
+        if (poll(fds.data(), fds.size(), dead.empty() ? kScanMs : 0) > 0) {
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i].revents != 0) {
+                    dead.push_back(pids[i]);
+                    close(fds[i].fd);
+                    pidfds.erase(pids[i]);
+                }
+            }
+        }
+
+        for (pid_t pid : dead) {
+            this->sem_set.reclaim_dead(pid);
+            this->reclaimed.fetch_add(1);
+            gone.insert(pid);
+        }
+    }
+
+    for (auto &[pid, pidfd] : pidfds) {
+        close(pidfd);
+    }
+}
+
+uint64_t HolderReaper::getReclaimed() const { return this->reclaimed.load(); }
+
+HolderReaper::~HolderReaper() {
+    if (getpid() != this->owner) {
+        /// @note: a forked child has a copy of the object but not the
+        /// thread, it can neither join it nor let std::thread terminate
+        (void)this->reaper.release();
+        return;
+    }
+    this->stopping.store(true);
+    this->reaper->join();
+}
+
+} // namespace lap
@@ -0,0 +1,263 @@
+#include "metrics_exporter.h"
+
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sys/sem.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "sem_shards.h"
+
+namespace lap {
+
+namespace {
+
+constexpr int32_t kPollMs    = 200; // how soon the server notices a stop
+constexpr int32_t kRequestMs = 100; // how long a client gets to send GET
+
+/// @note: label values escape backslash, quote and newline
+std::string escape_label(const std::string &value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n') {
+            out += "\\n";
+        }
+        else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+void write_help(std::ostream &os, const char *name, const char *type,
+  const char *help) {
+    os << "# HELP " << name << ' ' << help << '\n'
+       << "# TYPE " << name << ' ' << type << '\n';
+}
+
+/// @note: bucket b holds [2^b, 2^(b+1)) ns and the last one is open
+/// ended, so it only shows up in +Inf
+void write_histogram(std::ostream &os, const char *name,
+  const std::string &labels, const LatencyHistogram &hist) {
+    uint64_t counts[kHistBuckets];
+    hist.load(counts);
+
+    uint64_t total = 0;
+    for (int32_t b = 0; b < kHistBuckets - 1; ++b) {
+        total += counts[b];
+        os << name << "_bucket{" << labels << ",le=\""
+           << (double)(2ULL << b) / 1e9 << "\"} " << total << '\n';
+    }
+    total += counts[kHistBuckets - 1];
+    os << name << "_bucket{" << labels << ",le=\"+Inf\"} " << total << '\n'
+       << name << "_sum{" << labels << "} "
+       << hist.sum_ns.load(std::memory_order_relaxed) / 1e9 << '\n'
+       << name << "_count{" << labels << "} " << total << '\n';
+}
+
+bool send_all(int32_t fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n =
+          send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+} // namespace
+
+MetricsExporter::MetricsExporter(const SemaphoreSet &sem_set,
+  const char *socket_path, sem_label_map_t sem_labels)
+    : sem_set(sem_set), sem_labels(std::move(sem_labels)),
+      socket_path(socket_path), owner(getpid()) {
+    sockaddr_un addr = {};
+    addr.sun_family  = AF_UNIX;
+    if (this->socket_path.size() >= sizeof(addr.sun_path)) {
+        spdlog::error("Metrics socket path {} is too long", socket_path);
+        exit(1);
+    }
+    std::strcpy(addr.sun_path, socket_path);
+
+    /// @note: a socket file left behind by a previous run would make bind
+    /// fail
+    unlink(socket_path);
+    this->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (this->listen_fd == -1 ||
+        bind(this->listen_fd, (sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(this->listen_fd, 8) == -1)
+    {
+        spdlog::error("Error serving metrics on {} error {}", socket_path,
+          std::strerror(errno));
+        exit(1);
+    }
+
+    this->server =
+      std::make_unique< std::thread >([this] { this->serve(); });
+}
+
+void MetricsExporter::serve() {
+    while (!this->stopping.load()) {
+        pollfd pfd = {this->listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, kPollMs) <= 0) {
+            continue;
+        }
+        int32_t conn_fd = accept4(this->listen_fd, nullptr, nullptr,
+          SOCK_CLOEXEC);
+        if (conn_fd == -1) {
+            continue;
+        }
+        this->answer(conn_fd);
+        close(conn_fd);
+    }
+}
+
+void MetricsExporter::answer(int32_t conn_fd) {
+    char request[1024];
+    ssize_t len = 0;
+    pollfd pfd  = {conn_fd, POLLIN, 0};
+    if (poll(&pfd, 1, kRequestMs) > 0) {
+        len = recv(conn_fd, request, sizeof(request), 0);
+    }
+
+    std::string body = this->render();
+    if (len >= 4 && std::memcmp(request, "GET ", 4) == 0) {
+        send_all(conn_fd,
+          "HTTP/1.0 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Content-Length: " +
+            std::to_string(body.size()) + "\r\n\r\n");
+    }
+    send_all(conn_fd, body);
+}
+
+void MetricsExporter::write_metrics(std::ostream &os) const {
+    const ControlBlock *ctrl = this->sem_set.getControlBlock();
+
+    std::vector< unsigned short > vals(ctrl->num_sems);
+    if (!get_all_values(ctrl, vals.data())) {
+        spdlog::error("Error reading values of set {}: {}", ctrl->semids[0],
+          std::strerror(errno));
+        return;
+    }
+
+    std::vector< std::string > labels;
+    std::vector< int32_t > waiters(ctrl->num_sems);
+    std::vector< int32_t > holders(ctrl->num_sems);
+    for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+        const SemSlot &slot = ctrl->sems()[i];
+        auto name           = this->sem_labels.find(slot.name);
+        std::string sem     = std::to_string(slot.name);
+        if (name != this->sem_labels.end()) {
+            sem = name->second;
+        }
+        else if (slot.label[0] != '\0') {
+            sem = slot.label;
+        }
+        labels.push_back("semid=\"" + std::to_string(ctrl->semids[0]) +
+                         "\",sem=\"" + escape_label(sem) + "\"");
+        for (auto &holder : ctrl->sems()[i].holders) {
+            holders[i] += holder.pid.load(std::memory_order_relaxed) != 0;
+        }
+    }
+    for (auto &waiter : ctrl->waiters) {
+        if (waiter.pid.load(std::memory_order_relaxed) != 0) {
+            ++waiters[waiter.blocked_on];
+        }
+    }
+
+    auto per_sem = [&](const char *name, const char *type, const char *help,
+                     auto value_of) {
+        write_help(os, name, type, help);
+        for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+            os << name << '{' << labels[i] << "} " << value_of(i) << '\n';
+        }
+    };
+    per_sem("semset_value", "gauge", "Permits free right now.",
+      [&](int32_t i) { return vals[i]; });
+    per_sem("semset_capacity", "gauge", "Permits after the last resize.",
+      [&](int32_t i) { return ctrl->sems()[i].capacity.load(); });
+    per_sem("semset_holders", "gauge", "Processes holding permits.",
+      [&](int32_t i) { return holders[i]; });
+    per_sem("semset_waiters", "gauge", "Processes parked on the semaphore.",
+      [&](int32_t i) { return waiters[i]; });
+    per_sem("semset_acquisitions_total", "counter", "Permits acquired.",
+      [&](int32_t i) {
+          return ctrl->sems()[i].stats.acquisitions.load(
+            std::memory_order_relaxed);
+      });
+    per_sem("semset_parks_total", "counter", "Times a Swait parked.",
+      [&](int32_t i) {
+          return ctrl->sems()[i].stats.parks.load(std::memory_order_relaxed);
+      });
+    per_sem("semset_park_timeouts_total", "counter",
+      "Timed parks that ran out before a wake-up.", [&](int32_t i) {
+          return ctrl->sems()[i].stats.timeouts.load(
+            std::memory_order_relaxed);
+      });
+
+    std::string set_label =
+      "semid=\"" + std::to_string(ctrl->semids[0]) + "\"";
+    write_help(os, "semset_create_seconds", "gauge",
+      "Time the constructor of the creator took.");
+    os << "semset_create_seconds{" << set_label << "} "
+       << ctrl->create_ns / 1e9 << '\n';
+    write_help(os, "semset_park_sets", "gauge",
+      "1 once the set that waiters park on is made.");
+    os << "semset_park_sets{" << set_label << "} "
+       << (ctrl->park_semid.load() != -1) << '\n';
+
+    write_help(os, "semset_wait_seconds", "histogram",
+      "Time from Swait to the acquisition.");
+    for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+        write_histogram(
+          os, "semset_wait_seconds", labels[i], ctrl->sems()[i].stats.wait_ns);
+    }
+    write_help(os, "semset_hold_seconds", "histogram",
+      "Time from the acquisition to the Ssignal.");
+    for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+        write_histogram(
+          os, "semset_hold_seconds", labels[i], ctrl->sems()[i].stats.hold_ns);
+    }
+}
+
+std::string MetricsExporter::render() const {
+    std::ostringstream os;
+    this->write_metrics(os);
+    return os.str();
+}
+
+MetricsExporter::~MetricsExporter() {
+    if (getpid() != this->owner) {
+        /// @note: a forked child has a copy of the object but not the
+        /// thread, it can neither join it nor let std::thread terminate
+        (void)this->server.release();
+        close(this->listen_fd);
+        return;
+    }
+    this->stopping.store(true);
+    this->server->join();
+    close(this->listen_fd);
+    unlink(this->socket_path.c_str());
+}
+
+} // namespace lap
@@ -0,0 +1,201 @@
+#include "rate_limiter.h"
+
+#include <spdlog/spdlog.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <vector>
+
+#include "sem_clock.h"
+
+namespace lap {
+
+namespace {
+
+/// @note: every bucket starts full, every line and the lock free
+sem_name_id_map_t sem_names_of(const bucket_config_map_t &bucket_configs) {
+    int32_t num_buckets = bucket_configs.size();
+    sem_name_id_map_t sem_names;
+    for (const auto &[bucket_id, bucket_config] : bucket_configs) {
+        if (bucket_id >= num_buckets || bucket_config.rate <= 0 ||
+            bucket_config.burst <= 0 || bucket_config.burst > kMaxSemValue)
+        {
+            spdlog::error("Invalid config for bucket {}", bucket_id);
+            exit(1);
+        }
+        sem_names[bucket_id]               = bucket_config.burst;
+        sem_names[num_buckets + bucket_id] = 1;
+    }
+    sem_names[2 * num_buckets] = 1;
+    return sem_names;
+}
+
+std::vector< BucketConfig > configs_of(
+  const bucket_config_map_t &bucket_configs) {
+    std::vector< BucketConfig > configs(bucket_configs.size());
+    for (const auto &[bucket_id, bucket_config] : bucket_configs) {
+        configs[bucket_id] = bucket_config;
+    }
+    return configs;
+}
+
+} // namespace
+
+RateLimiter::RateLimiter(const bucket_config_map_t &bucket_configs)
+    : num_buckets(bucket_configs.size()),
+      configs(configs_of(bucket_configs)),
+      sem_set(IPC_PRIVATE, sem_names_of(bucket_configs)),
+      lock_numid(2 * bucket_configs.size()) {
+    void *mem = mmap(nullptr, num_buckets * sizeof(std::atomic< int64_t >),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        spdlog::error("Error creating rate limiter in {}", __LINE__);
+        exit(1);
+    }
+    this->refilled_ns = (std::atomic< int64_t > *)mem;
+
+    int64_t now_ns = monotonic_ns();
+    for (int32_t bucket_id = 0; bucket_id < num_buckets; ++bucket_id) {
+        new (&this->refilled_ns[bucket_id]) std::atomic< int64_t >(now_ns);
+    }
+}
+
+sem_nameid_t RateLimiter::line_of(sem_nameid_t bucket_id) const {
+    return this->num_buckets + bucket_id;
+}
+
+bool RateLimiter::check_request(
+  sem_nameid_t bucket_id, int32_t permits) const {
+    if (bucket_id >= this->num_buckets) {
+        spdlog::error("No bucket {}, there are {}", bucket_id,
+          this->num_buckets);
+        return false;
+    }
+    if (permits <= 0 || permits > this->configs[bucket_id].burst) {
+        spdlog::error("Asking {} permits from bucket {} of burst {}",
+          permits, bucket_id, this->configs[bucket_id].burst);
+        return false;
+    }
+    return true;
+}
+
+int32_t RateLimiter::refill(sem_nameid_t bucket_id, int64_t now_ns) {
+    const BucketConfig &config = this->configs[bucket_id];
+    std::atomic< int64_t > &refilled_ns = this->refilled_ns[bucket_id];
+    int32_t tokens = this->sem_set.getVal(bucket_id);
+
+    double ns_per_token = 1e9 / config.rate;
+    int64_t earned = (int64_t)((now_ns - refilled_ns.load()) / ns_per_token);
+    if (earned <= 0) {
+        return tokens;
+    }
+
+    if (tokens + earned >= config.burst) {
+        /// @note: a full bucket does not bank the time it spent full
+        earned = config.burst - tokens;
+        refilled_ns.store(now_ns);
+    }
+    else {
+        /// @note: only advance by whole tokens, the fraction carries over
+        refilled_ns.fetch_add((int64_t)(earned * ns_per_token));
+    }
+    this->sem_set.adjust_capacity(bucket_id, (int16_t)earned);
+    return tokens + earned;
+}
+
+int64_t RateLimiter::take_or_wait_ns(sem_nameid_t bucket_id, int32_t permits) {
+    int64_t now_ns = monotonic_ns();
+    int32_t tokens = this->refill(bucket_id, now_ns);
+    if (tokens >= permits) {
+        /// @note: under the lock nobody else takes from the bucket, so
+        /// the shrink gets every permit it asks for. A spent token belongs
+        /// to no one and is not given back
+        this->sem_set.adjust_capacity(bucket_id, (int16_t)-permits);
+        return 0;
+    }
+
+    int64_t wait_ns =
+      (int64_t)std::ceil(
+        (permits - tokens) * 1e9 / this->configs[bucket_id].rate) -
+      (now_ns - this->refilled_ns[bucket_id].load());
+    return std::max< int64_t >(wait_ns, 1);
+}
+
+bool RateLimiter::Swait(
+  sem_nameid_t bucket_id, int32_t permits, CallSite site) {
+    if (!this->check_request(bucket_id, permits)) {
+        return false;
+    }
+
+    sem_nameid_min_val_vec_t lock = {
+      {this->lock_numid, {1, -1}}
+    };
+    bool in_line = false;
+    while (true) {
+        this->sem_set.Swait(lock, site);
+        int64_t wait_ns = this->take_or_wait_ns(bucket_id, permits);
+        this->sem_set.Ssignal(this->lock_numid);
+        if (wait_ns == 0) {
+            break;
+        }
+        if (!in_line) {
+            this->sem_set.Swait({{this->line_of(bucket_id), {1, -1}}}, site);
+            in_line = true;
+            continue;
+        }
+
+        /// @note: first in line, the others block on the semaphore
+        /// meanwhile. Sleep exactly until the missing tokens are earned,
+        /// a Strywait may still take them first and we go around again
+        timespec ts = {wait_ns / 1000000000LL, wait_ns % 1000000000LL};
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        }
+    }
+    if (in_line) {
+        this->sem_set.Ssignal(this->line_of(bucket_id));
+    }
+    return true;
+}
+
+bool RateLimiter::Strywait(
+  sem_nameid_t bucket_id, int32_t permits, CallSite site) {
+    if (!this->check_request(bucket_id, permits)) {
+        return false;
+    }
+    this->sem_set.Swait({{this->lock_numid, {1, -1}}}, site);
+    int64_t wait_ns = this->take_or_wait_ns(bucket_id, permits);
+    this->sem_set.Ssignal(this->lock_numid);
+    return wait_ns == 0;
+}
+
+/// @note: the tokens as of the last acquisition, without the refill
+/// earned since
+int32_t RateLimiter::getVal(sem_nameid_t bucket_id) const {
+    if (bucket_id >= this->num_buckets) {
+        spdlog::error("No bucket {}, there are {}", bucket_id,
+          this->num_buckets);
+        exit(1);
+    }
+    return this->sem_set.getVal(bucket_id);
+}
+
+SemaphoreSet &RateLimiter::getSemaphoreSet() {
+    return this->sem_set;
+}
+
+/// @note: the set removes itself in the creator only
+RateLimiter::~RateLimiter() {
+    if (this->refilled_ns != nullptr) {
+        munmap(
+          this->refilled_ns, num_buckets * sizeof(std::atomic< int64_t >));
+    }
+}
+
+} // namespace lap
@@ -0,0 +1,47 @@
+#include "sem_id_map.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace lap {
+
+SemIdMap::SemIdMap(std::vector< uint16_t > ids) : ids(std::move(ids)) {
+    std::sort(this->ids.begin(), this->ids.end());
+    this->build();
+}
+
+SemIdMap SemIdMap::in_index_order(std::vector< uint16_t > ids) {
+    SemIdMap map;
+    map.ids = std::move(ids);
+    map.build();
+    return map;
+}
+
+void SemIdMap::build() {
+    for (size_t i = 0; i < this->ids.size() && this->dense; ++i) {
+        this->dense = this->ids[i] == i;
+    }
+    if (this->dense) {
+        return;
+    }
+
+    this->bits = 1;
+    while ((1u << this->bits) < 2 * this->ids.size()) {
+        ++this->bits;
+    }
+    this->slots.assign(1u << this->bits, -1);
+    for (size_t i = 0; i < this->ids.size(); ++i) {
+        this->insert(i);
+    }
+}
+
+void SemIdMap::insert(int32_t index) {
+    uint32_t mask = (1u << this->bits) - 1;
+    uint32_t slot = sem_id_slot(this->ids[index], this->multiplier, this->bits);
+    while (this->slots[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    this->slots[slot] = index;
+}
+
+} // namespace lap
@@ -0,0 +1,44 @@
+#include "sem_shards.h"
+
+#include <sys/sem.h>
+
+#include <fstream>
+
+namespace lap {
+
+SemLimits read_sem_limits() {
+    SemLimits limits = {32000, 1024000000, 500, 32000};
+    std::ifstream proc("/proc/sys/kernel/sem");
+    SemLimits read;
+    if (proc >> read.semmsl >> read.semmns >> read.semopm >> read.semmni) {
+        limits = read;
+    }
+    return limits;
+}
+
+bool get_all_values(const ControlBlock *ctrl, unsigned short *vals) {
+    if (ctrl->threads) {
+        for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+            vals[i] = ctrl->sems()[i].value.load(std::memory_order_relaxed);
+        }
+        return true;
+    }
+    for (int32_t shard = 0; shard < ctrl->num_shards; ++shard) {
+        if (!get_shard_values(ctrl, shard, vals + shard * ctrl->shard_size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool get_shard_values(
+  const ControlBlock *ctrl, int32_t shard, unsigned short *vals) {
+    union {
+        int val;
+        unsigned short *array;
+    } arg;
+    arg.array = vals;
+    return semctl(ctrl->semids[shard], 0, GETALL, arg) != -1;
+}
+
+} // namespace lap
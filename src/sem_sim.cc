@@ -0,0 +1,525 @@
+#include "sem_sim.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace lap {
+
+namespace {
+
+/// @note: splitmix64, the same sequence on every platform, unlike the
+/// distributions of <random>
+uint64_t next_random(uint64_t &state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z          = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/// @note: indexed by SimSemaphoreSet::SimSetId
+const char *set_name(int32_t set) {
+    static const char *names[] = {"main", "park"};
+    return names[set];
+}
+
+} // namespace
+
+SimSemaphoreSet::SimSemaphoreSet(SimConfig config)
+    : config(std::move(config)) {
+    for (auto &program : this->config.programs) {
+        for (auto &action : program) {
+            if (action.kind == SimAction::SWAIT &&
+                action.request.size() > (size_t)kMaxWaitOps)
+            {
+                spdlog::error("Simulated Swait with more than {} semaphores",
+                  kMaxWaitOps);
+                exit(1);
+            }
+        }
+    }
+}
+
+void SimSemaphoreSet::reset() {
+    int32_t num_sems  = this->config.initial_values.size();
+    int32_t num_procs = this->config.programs.size();
+    this->values[SIM_MAIN] = this->config.initial_values;
+    this->values[SIM_PARK].assign(num_procs, 0);
+    this->reserved.assign(num_sems, 0);
+    this->procs.assign(num_procs, Process{});
+    for (auto &proc : this->procs) {
+        proc.held.assign(num_sems, 0);
+    }
+    this->runnable.clear();
+    for (int32_t pid = 0; pid < num_procs; ++pid) {
+        if (this->config.programs[pid].empty()) {
+            continue;
+        }
+        this->runnable.push_back(pid);
+    }
+    this->blocked.clear();
+    this->next_ticket   = 0;
+    this->num_shared    = 0;
+    this->num_exclusive = 0;
+    this->num_finished  = num_procs - this->runnable.size();
+    this->result        = {true, "", 0, {}};
+}
+
+void SimSemaphoreSet::note(int32_t pid, const std::string &what) {
+    if (this->config.record_trace) {
+        this->result.trace.push_back(
+          "[" + std::to_string(this->result.steps) + "] p" +
+          std::to_string(pid) + " " + what);
+    }
+}
+
+void SimSemaphoreSet::fail(int32_t pid, const std::string &why) {
+    if (this->result.ok) {
+        this->result.ok      = false;
+        this->result.failure = "p" + std::to_string(pid) + " " + why;
+    }
+}
+
+bool SimSemaphoreSet::try_semop(
+  int32_t set, const SimOp *ops, int32_t num_ops) {
+    std::vector< int32_t > &vals = this->values[set];
+    int32_t done                 = 0;
+    for (; done < num_ops; ++done) {
+        int32_t &val = vals[ops[done].sem_num];
+        if ((ops[done].sem_op < 0 && val + ops[done].sem_op < 0) ||
+            (ops[done].sem_op == 0 && val != 0))
+        {
+            break;
+        }
+        val += ops[done].sem_op;
+    }
+    if (done == num_ops) {
+        return true;
+    }
+    while (done-- > 0) {
+        vals[ops[done].sem_num] -= ops[done].sem_op;
+    }
+    return false;
+}
+
+void SimSemaphoreSet::semop(int32_t pid, int32_t set, const SimOp *ops,
+  int32_t num_ops, int32_t resume_phase) {
+    Process &proc = this->procs[pid];
+    proc.phase    = resume_phase;
+    if (this->try_semop(set, ops, num_ops)) {
+        this->update_queue();
+        return;
+    }
+
+    proc.blocked      = true;
+    proc.wait_set     = set;
+    proc.num_wait_ops = num_ops;
+    std::copy(ops, ops + num_ops, proc.wait_ops);
+    this->blocked.push_back(pid);
+    this->runnable.erase(
+      std::find(this->runnable.begin(), this->runnable.end(), pid));
+    this->note(pid, std::string("parks on ") + set_name(set) + " sem " +
+                      std::to_string(ops[0].sem_num));
+}
+
+void SimSemaphoreSet::update_queue() {
+    for (size_t i = 0; i < this->blocked.size();) {
+        int32_t pid   = this->blocked[i];
+        Process &proc = this->procs[pid];
+        if (!this->try_semop(proc.wait_set, proc.wait_ops, proc.num_wait_ops))
+        {
+            ++i;
+            continue;
+        }
+
+        proc.blocked = false;
+        this->blocked.erase(this->blocked.begin() + i);
+        this->runnable.push_back(pid);
+        this->note(pid, std::string("woken on ") + set_name(proc.wait_set) +
+                          " sem " + std::to_string(proc.wait_ops[0].sem_num));
+        /// @note: what it took may unblock nobody, what it gave back may
+        /// unblock older ones again
+        i = 0;
+    }
+}
+
+void SimSemaphoreSet::finish_action(Process &proc) {
+    proc.phase = 0;
+    proc.index = 0;
+    if (++proc.pc == this->config.programs[&proc - this->procs.data()].size())
+    {
+        ++this->num_finished;
+        this->runnable.erase(std::find(this->runnable.begin(),
+          this->runnable.end(), (int32_t)(&proc - this->procs.data())));
+    }
+}
+
+/// @note: mirrors SemaphoreSet::legacy_wait
+///     0  semop of the whole request with IPC_NOWAIT
+///     1  GETVAL one entry, the first one short is the blocker
+///     2  publish the blocker in the waiter table
+///     3  GETVAL the blocker again
+///     4  park on the own semaphore of the slot
+void SimSemaphoreSet::step_legacy_wait(int32_t pid, const SimAction &action) {
+    Process &proc = this->procs[pid];
+    switch (proc.phase) {
+        case 0: {
+            SimOp ops[kMaxSimOps];
+            int32_t num_ops = 0;
+            for (auto &[sem, op] : action.request) {
+                int32_t need = needed_value(op.min_val, op.sem_op);
+                if (need > 0) {
+                    ops[num_ops++] = {sem, -need};
+                }
+                if (need + op.sem_op != 0) {
+                    ops[num_ops++] = {sem, need + op.sem_op};
+                }
+            }
+            if (!this->try_semop(SIM_MAIN, ops, num_ops)) {
+                this->note(pid, "Swait finds the request short");
+                proc.phase = 1;
+                proc.index = 0;
+                return;
+            }
+            this->note(pid, "Swait acquires");
+            this->update_queue();
+            proc.registered = false;
+            this->finish_action(proc);
+            return;
+        }
+        case 1: {
+            auto &[sem, op] = action.request[proc.index];
+            if (this->values[SIM_MAIN][sem] <
+                needed_value(op.min_val, op.sem_op))
+            {
+                proc.blocked_on = sem;
+                proc.phase      = 2;
+            }
+            else if (++proc.index == (int32_t)action.request.size()) {
+                proc.phase = 0;
+            }
+            return;
+        }
+        case 2:
+            proc.registered = true;
+            this->note(pid, "waits on sem " + std::to_string(proc.blocked_on));
+            proc.phase = 3;
+            return;
+        case 3: {
+            auto entry = std::find_if(action.request.begin(),
+              action.request.end(),
+              [&](const auto &it) { return it.first == proc.blocked_on; });
+            proc.phase = this->values[SIM_MAIN][proc.blocked_on] >=
+                             needed_value(
+                               entry->second.min_val, entry->second.sem_op)
+                           ? 0
+                           : 4;
+            return;
+        }
+        case 4: {
+            SimOp park = {pid, -1};
+            this->semop(pid, SIM_PARK, &park, 1, 0);
+            return;
+        }
+    }
+}
+
+/// @note: mirrors the legacy part of SemaphoreSet::Ssignal
+///     0  semop giving the permits back
+///     1  read one entry of the waiter table
+///     2  GETALL the park set, drop the waiters that have a token
+///     3  post a token to each of the others
+void SimSemaphoreSet::step_legacy_signal(
+  int32_t pid, const SimAction &action) {
+    Process &proc = this->procs[pid];
+    switch (proc.phase) {
+        case 0: {
+            SimOp give = {action.sem_numid, action.sem_op};
+            this->semop(pid, SIM_MAIN, &give, 1, 1);
+            this->note(pid, "Ssignal sem " + std::to_string(action.sem_numid));
+            proc.index = 0;
+            proc.wake.clear();
+            return;
+        }
+        case 1: {
+            Process &other = this->procs[proc.index];
+            if (other.registered && other.blocked_on == action.sem_numid) {
+                proc.wake.push_back(proc.index);
+            }
+            if (++proc.index == (int32_t)this->procs.size()) {
+                proc.phase = proc.wake.empty() ? 0 : 2;
+                if (proc.wake.empty()) {
+                    this->finish_action(proc);
+                }
+            }
+            return;
+        }
+        case 2:
+            proc.wake.erase(std::remove_if(proc.wake.begin(), proc.wake.end(),
+                              [&](int32_t slot) {
+                                  return this->values[SIM_PARK][slot] > 0;
+                              }),
+              proc.wake.end());
+            proc.phase = 3;
+            if (proc.wake.empty()) {
+                this->finish_action(proc);
+            }
+            return;
+        case 3: {
+            std::vector< SimOp > wake;
+            for (int32_t slot : proc.wake) {
+                wake.push_back({slot, 1});
+            }
+            this->semop(pid, SIM_PARK, wake.data(), wake.size(), 0);
+            this->finish_action(proc);
+            return;
+        }
+    }
+}
+
+/// @note: mirrors SemaphoreSet::handoff_wait, each phase is one section
+/// under the control block lock
+///     0  take the request or join the waiters
+///     1  park on the own semaphore of the slot
+///     2  pick up the permits reserved by grant_waiters
+void SimSemaphoreSet::step_handoff_wait(int32_t pid, const SimAction &action) {
+    Process &proc = this->procs[pid];
+    switch (proc.phase) {
+        case 0: {
+            int32_t blocker = -1;
+            for (auto &[sem, op] : action.request) {
+                if (this->values[SIM_MAIN][sem] - this->reserved[sem] <
+                    needed_value(op.min_val, op.sem_op))
+                {
+                    blocker = sem;
+                    break;
+                }
+            }
+            bool others_wait = std::any_of(this->procs.begin(),
+              this->procs.end(), [](const Process &p) { return p.registered; });
+            if (blocker != -1 || others_wait) {
+                proc.registered = true;
+                proc.granted    = false;
+                proc.blocked_on =
+                  blocker != -1 ? blocker : action.request.front().first;
+                proc.ticket = this->next_ticket++;
+                proc.phase  = 1;
+                this->note(pid, "waits on sem " +
+                                  std::to_string(proc.blocked_on));
+                if (blocker == -1) {
+                    this->grant_waiters(pid);
+                    this->update_queue();
+                }
+                return;
+            }
+            for (auto &[sem, op] : action.request) {
+                this->values[SIM_MAIN][sem] += op.sem_op;
+                proc.held[sem] -= std::min(op.sem_op, 0);
+            }
+            this->note(pid, "Swait acquires");
+            this->update_queue();
+            this->finish_action(proc);
+            return;
+        }
+        case 1: {
+            SimOp park = {pid, -1};
+            this->semop(pid, SIM_PARK, &park, 1, 2);
+            return;
+        }
+        case 2:
+            for (auto &[sem, op] : action.request) {
+                this->values[SIM_MAIN][sem] += op.sem_op;
+                if (op.sem_op < 0) {
+                    this->reserved[sem] += op.sem_op;
+                    proc.held[sem] -= op.sem_op;
+                }
+            }
+            proc.registered = false;
+            this->note(pid, "Swait picks up the hand-off");
+            this->update_queue();
+            this->finish_action(proc);
+            return;
+    }
+}
+
+/// @note: mirrors the hand-off part of SemaphoreSet::Ssignal, one section
+/// under the control block lock
+void SimSemaphoreSet::step_handoff_signal(
+  int32_t pid, const SimAction &action) {
+    this->values[SIM_MAIN][action.sem_numid] += action.sem_op;
+    int32_t &held = this->procs[pid].held[action.sem_numid];
+    held          = std::max(held - action.sem_op, 0);
+    this->note(pid, "Ssignal sem " + std::to_string(action.sem_numid));
+    this->grant_waiters(pid);
+    this->update_queue();
+    this->finish_action(this->procs[pid]);
+}
+
+/// @note: mirrors SemaphoreSet::grant_waiters, floors included: what a
+/// granted entry only checks and what a waiter that does not fit yet
+/// needs are left to it by every younger waiter that holds none of what
+/// it is short of
+void SimSemaphoreSet::grant_waiters(int32_t pid) {
+    std::vector< int32_t > order;
+    for (int32_t other = 0; other < (int32_t)this->procs.size(); ++other) {
+        if (this->procs[other].registered && !this->procs[other].granted) {
+            order.push_back(other);
+        }
+    }
+    std::sort(order.begin(), order.end(), [this](int32_t a, int32_t b) {
+        return this->procs[a].ticket < this->procs[b].ticket;
+    });
+
+    std::vector< int32_t > avail = this->values[SIM_MAIN];
+    std::vector< int32_t > floor(avail.size(), 0);
+    for (size_t i = 0; i < avail.size(); ++i) {
+        avail[i] -= this->reserved[i];
+    }
+
+    /// older waiters that did not fit, with the sems they were short of
+    std::vector< std::pair< int32_t, std::vector< int32_t > > > passed;
+    auto held_back = [&](int32_t younger, int32_t sem) {
+        int32_t held_floor = 0;
+        for (auto &[older, short_of] : passed) {
+            bool holds = std::any_of(short_of.begin(), short_of.end(),
+              [&](int32_t s) { return this->procs[younger].held[s] > 0; });
+            const SimAction &wait =
+              this->config.programs[older][this->procs[older].pc];
+            for (auto &[older_sem, op] : wait.request) {
+                if (!holds && older_sem == sem) {
+                    held_floor = std::max(
+                      held_floor, needed_value(op.min_val, op.sem_op));
+                }
+            }
+        }
+        return held_floor;
+    };
+
+    for (int32_t other : order) {
+        const SimAction &wait =
+          this->config.programs[other][this->procs[other].pc];
+        std::vector< int32_t > short_of;
+        for (auto &[sem, op] : wait.request) {
+            bool fits = avail[sem] >= needed_value(op.min_val, op.sem_op);
+            if (fits && op.sem_op < 0) {
+                fits = avail[sem] + op.sem_op >=
+                       std::max(floor[sem], held_back(other, sem));
+            }
+            if (!fits) {
+                short_of.push_back(sem);
+            }
+        }
+        if (!short_of.empty()) {
+            passed.push_back({other, short_of});
+            continue;
+        }
+        for (auto &[sem, op] : wait.request) {
+            int32_t take = std::max(-op.sem_op, 0);
+            avail[sem] -= take;
+            floor[sem] =
+              std::max(floor[sem], needed_value(op.min_val, op.sem_op) - take);
+            this->reserved[sem] += take;
+        }
+        this->procs[other].granted = true;
+        this->values[SIM_PARK][other] += 1;
+        this->note(pid, "hands off to p" + std::to_string(other));
+    }
+}
+
+void SimSemaphoreSet::step_section(int32_t pid, const SimAction &action) {
+    switch (action.kind) {
+        case SimAction::ENTER_SHARED:
+            ++this->num_shared;
+            this->note(pid, "enters shared");
+            break;
+        case SimAction::LEAVE_SHARED:
+            --this->num_shared;
+            this->note(pid, "leaves shared");
+            break;
+        case SimAction::ENTER_EXCLUSIVE:
+            ++this->num_exclusive;
+            this->note(pid, "enters exclusive");
+            break;
+        default:
+            --this->num_exclusive;
+            this->note(pid, "leaves exclusive");
+            break;
+    }
+
+    if (this->num_exclusive > 1 ||
+        (this->num_exclusive > 0 && this->num_shared > 0) ||
+        this->num_shared > this->config.max_shared)
+    {
+        this->fail(pid, "broke the invariants: " +
+                          std::to_string(this->num_shared) + " shared and " +
+                          std::to_string(this->num_exclusive) +
+                          " exclusive inside");
+    }
+    this->finish_action(this->procs[pid]);
+}
+
+void SimSemaphoreSet::step(int32_t pid) {
+    const SimAction &action =
+      this->config.programs[pid][this->procs[pid].pc];
+    switch (action.kind) {
+        case SimAction::SWAIT:
+            if (this->config.handoff) {
+                this->step_handoff_wait(pid, action);
+            }
+            else {
+                this->step_legacy_wait(pid, action);
+            }
+            break;
+        case SimAction::SSIGNAL:
+            if (this->config.handoff) {
+                this->step_handoff_signal(pid, action);
+            }
+            else {
+                this->step_legacy_signal(pid, action);
+            }
+            break;
+        default:
+            this->step_section(pid, action);
+            break;
+    }
+}
+
+const SimResult &SimSemaphoreSet::run(uint64_t seed) {
+    this->reset();
+    uint64_t state = seed;
+    while (this->result.ok && !this->runnable.empty()) {
+        if (this->result.steps == this->config.max_steps) {
+            this->fail(this->runnable.front(),
+              "still running after " + std::to_string(this->result.steps) +
+                " steps, livelock");
+            break;
+        }
+        int32_t pid =
+          this->runnable[next_random(state) % this->runnable.size()];
+        ++this->result.steps;
+        this->step(pid);
+    }
+
+    if (this->result.ok &&
+        this->num_finished < (int32_t)this->procs.size())
+    {
+        std::string parked;
+        for (int32_t pid : this->blocked) {
+            parked += " p" + std::to_string(pid) + "@" +
+                      set_name(this->procs[pid].wait_set) + "[" +
+                      std::to_string(this->procs[pid].wait_ops[0].sem_num) +
+                      "]";
+        }
+        std::string vals;
+        for (int32_t val : this->values[SIM_MAIN]) {
+            vals += " " + std::to_string(val);
+        }
+        this->fail(this->blocked.front(),
+          "and the others are parked for good:" + parked + ", values" + vals);
+    }
+    return this->result;
+}
+
+} // namespace lap
@@ -0,0 +1,94 @@
+#include "sem_trace.h"
+
+#include <spdlog/spdlog.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace lap {
+
+std::vector< TraceRecord > TraceRing::snapshot() {
+    uint64_t end   = head.load(std::memory_order_acquire);
+    uint64_t begin = end > capacity ? end - capacity : 0;
+
+    std::vector< TraceRecord > out;
+    out.reserve(end - begin);
+    for (uint64_t pos = begin; pos < end; ++pos) {
+        TraceRecord &rd = records()[pos & (capacity - 1)];
+        uint32_t want   = (uint32_t)(pos + 1);
+        if (__atomic_load_n(&rd.seq, __ATOMIC_ACQUIRE) != want) {
+            continue; // still being written, or overwritten already
+        }
+
+        /// @note: a writer may lap us while we copy, check again after
+        TraceRecord copy = rd;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rd.seq, __ATOMIC_RELAXED) == want) {
+            out.push_back(copy);
+        }
+    }
+    return out;
+}
+
+const char *trace_op_name(uint8_t op) {
+    switch (op) {
+        case TRACE_WAIT_BEGIN:
+            return "wait";
+        case TRACE_PARK:
+            return "park";
+        case TRACE_ACQUIRE:
+            return "acquire";
+        case TRACE_ABORT:
+            return "abort";
+        case TRACE_SIGNAL:
+            return "signal";
+        case TRACE_RECLAIM:
+            return "reclaim";
+        case TRACE_RESIZE:
+            return "resize";
+        default:
+            return "unknown";
+    }
+}
+
+bool write_trace_file(TraceRing &ring, const char *path) {
+    std::vector< TraceRecord > records = ring.snapshot();
+    FILE *fp                           = std::fopen(path, "wb");
+    if (fp == nullptr) {
+        spdlog::error("Error opening trace file {}", path);
+        return false;
+    }
+
+    uint32_t header[2] = {TraceRing::kMagic, (uint32_t)records.size()};
+    bool ok            = std::fwrite(header, sizeof(header), 1, fp) == 1 &&
+              std::fwrite(records.data(), sizeof(TraceRecord), records.size(),
+                fp) == records.size();
+    std::fclose(fp);
+    return ok;
+}
+
+std::vector< TraceRecord > read_trace_file(const char *path) {
+    std::vector< TraceRecord > records;
+    FILE *fp = std::fopen(path, "rb");
+    if (fp == nullptr) {
+        spdlog::error("Error opening trace file {}", path);
+        return records;
+    }
+
+    uint32_t header[2];
+    if (std::fread(header, sizeof(header), 1, fp) != 1 ||
+        header[0] != TraceRing::kMagic)
+    {
+        spdlog::error("{} is not a trace dump", path);
+        std::fclose(fp);
+        return records;
+    }
+    records.resize(header[1]);
+    records.resize(
+      std::fread(records.data(), sizeof(TraceRecord), header[1], fp));
+    std::fclose(fp);
+    return records;
+}
+
+} // namespace lap
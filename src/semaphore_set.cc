@@ -1,18 +1,35 @@
 #include "semaphore_set.h"
 
 #include <spdlog/spdlog.h>
+#include <fcntl.h>
 #include <sys/ipc.h>
 #include <sys/mman.h>
 #include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <utility>
 
 #if __cplusplus >= 202002L
 #include <source_location>
 #endif
 
+#include "sem_clock.h"
+#include "sem_shards.h"
+
 namespace lap {
 
 #if __cplusplus >= 202002L
@@ -20,7 +37,7 @@ namespace lap {
 void SemaphoreSet::sem_operation(
   sem_nameid_t sem_numid, int16_t sem_op, std::source_location loc) {
     sembuf ops = {sem_numid, sem_op, SEM_UNDO};
-    if (semop(this->semid, &ops, 1) == -1) {
+    if (this->shard_semop(this->semids, &ops, 1) == -1) {
         spdlog::error("Error signaling semaphore  happen in {} func {}",
           loc.line(), loc.function_name());
         exit(1);
@@ -30,9 +47,9 @@ void SemaphoreSet::sem_operation(
 /// @note: use to block oneself
 /// when we find the resource is not enough to distribute(value < min_val),
 void SemaphoreSet::block_oneself_or_release(
-  sem_nameid_t who, int16_t sem_op, std::source_location loc) {
-    sembuf ops = {who, sem_op, SEM_UNDO};
-    if (semop(this->block_oneself_semid, &ops, 1) == -1) {
+  int32_t who, int16_t sem_op, std::source_location loc) {
+    sembuf ops = {(unsigned short)who, sem_op, 0};
+    if (semop(this->park_semid, &ops, 1) == -1) {
         spdlog::error("Error signaling semaphore  happen in {} func {}",
           loc.line(), loc.function_name());
         exit(1);
@@ -43,7 +60,7 @@ void SemaphoreSet::block_oneself_or_release(
 
 void SemaphoreSet::sem_operation(sem_nameid_t sem_numid, int16_t sem_op) {
     sembuf ops = {sem_numid, sem_op, SEM_UNDO};
-    if (semop(this->semid, &ops, 1) == -1) {
+    if (this->shard_semop(this->semids, &ops, 1) == -1) {
         spdlog::error("Error signaling semaphore  happen in {} func {}",
           __LINE__, __FUNCTION__);
         exit(1);
@@ -52,9 +69,9 @@ void SemaphoreSet::sem_operation(sem_nameid_t sem_numid, int16_t sem_op) {
 
 /// @note: use to block oneself
 /// when we find the resource is not enough to distribute(value < min_val),
-void SemaphoreSet::block_oneself_or_release(sem_nameid_t who, int16_t sem_op) {
-    sembuf ops = {who, sem_op, SEM_UNDO};
-    if (semop(this->block_oneself_semid, &ops, 1) == -1) {
+void SemaphoreSet::block_oneself_or_release(int32_t who, int16_t sem_op) {
+    sembuf ops = {(unsigned short)who, sem_op, 0};
+    if (semop(this->park_semid, &ops, 1) == -1) {
         spdlog::error("Error signaling semaphore  happen in {} func {}",
           __LINE__, __FUNCTION__);
         exit(1);
@@ -63,151 +80,1994 @@ void SemaphoreSet::block_oneself_or_release(sem_nameid_t who, int16_t sem_op) {
 
 #endif
 
-SemaphoreSet::SemaphoreSet(key_t key, const sem_name_id_map_t &sem_names)
-    : num_sems(sem_names.size()) {
-    this->semid               = semget(key, num_sems, IPC_CREAT | 0666);
-    this->block_oneself_semid = semget(key, num_sems, IPC_CREAT | 0666);
-
-    /// @note: every sem has a record to record who block me
-    /// new get memory is not shared, but mmap can be shared
-    this->ptr_record_who_block_me = new int16_t *;
-    (*(this->ptr_record_who_block_me)) =
-      (int16_t *)mmap(nullptr, num_sems * sizeof(int16_t),
-        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    std::fill((*(this->ptr_record_who_block_me)),
-      (*(this->ptr_record_who_block_me)) + num_sems, -1);
-
-    if (this->semid == -1 || this->block_oneself_semid == -1) {
-        spdlog::error("Error creating semaphore set in {}", __LINE__);
-        this->~SemaphoreSet();
-        check_semctl_error();
+namespace {
+
+/// how long an attaching process waits for the creator of the set
+constexpr int64_t kAttachTimeoutNs = 5000000000;
+
+/// @note: every SemaphoreSet alive in this process, for the fork hooks.
+/// The mutex is held across fork, a child never sees the list half done
+std::mutex live_handles_mutex;
+std::vector< SemaphoreSet * > live_handles;
+std::once_flag atfork_once;
+
+/// FNV-1a, names are short and hashed only when set or looked up
+uint32_t hash_name(const std::string &name) {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return hash;
+}
+
+/// @note: a control block to attach to, made ready by a creator that
+/// is still alive. A block whose creator is gone was left over by an
+/// earlier run and is about to be reset
+bool ready_and_live(const ControlBlock *ctrl) {
+    return ctrl->magic == ControlBlock::kMagic &&
+           ctrl->ready.load(std::memory_order_acquire) != 0 &&
+           (kill(ctrl->creator, 0) == 0 || errno == EPERM);
+}
+
+/// @note: the control block segment of a new set under `key`. One that
+/// is in use, ready with its creator alive or still being made by a
+/// creator that is alive, is never taken over and -1 comes back with
+/// EBUSY. One left behind by an earlier run is removed whatever its size
+/// and made anew
+int32_t create_key_segment(key_t key, size_t size) {
+    while (true) {
+        int32_t shmid = shmget(key, size, IPC_CREAT | IPC_EXCL | 0666);
+        if (shmid != -1 || errno != EEXIST) {
+            return shmid;
+        }
+        shmid = shmget(key, 0, 0);
+        struct shmid_ds ds;
+        void *addr = shmid == -1 || shmctl(shmid, IPC_STAT, &ds) == -1
+                       ? (void *)-1
+                       : shmat(shmid, nullptr, 0);
+        if (addr == (void *)-1 && (errno == ENOENT || errno == EIDRM)) {
+            continue;
+        }
+        if (addr == (void *)-1) {
+            return -1;
+        }
+
+        auto *ctrl    = (const ControlBlock *)addr;
+        bool creating = kill(ds.shm_cpid, 0) == 0 || errno == EPERM;
+        bool in_use   = ds.shm_segsz < sizeof(ControlBlock)
+                          ? creating
+                          : ready_and_live(ctrl) ||
+                            (ctrl->ready.load() == 0 && creating);
+        shmdt(addr);
+        if (in_use) {
+            errno = EBUSY;
+            return -1;
+        }
+        shmctl(shmid, IPC_RMID, nullptr);
+    }
+}
+
+std::vector< uint16_t > ids_of(const sem_name_id_map_t &sem_names) {
+    std::vector< uint16_t > ids;
+    for (const auto &sem_name : sem_names) {
+        ids.push_back(sem_name.first);
+    }
+    return ids;
+}
+
+} // namespace
+
+SemaphoreSet::SemaphoreSet(
+  key_t key, const sem_name_id_map_t &sem_names, SemSetConfig config)
+    : SemaphoreSet(key, sem_names, SemIdMap(ids_of(sem_names)), config) {}
+
+SemaphoreSet::SemaphoreSet(key_t key, const sem_name_id_map_t &sem_names,
+  SemIdMap ids, SemSetConfig config)
+    : num_sems(sem_names.size()), inner_sem_numid(kMaxWaiters),
+      config(config), owns_sets(true), self_pid(getpid()),
+      ids(std::move(ids)), held_by(sem_names.size()) {
+    int64_t begin_ns = monotonic_ns();
+    if (this->ids.size() != num_sems) {
+        spdlog::error("{} semaphore ids for {} semaphores", this->ids.size(),
+          num_sems);
+        exit(1);
+    }
+    if (this->config.threads &&
+        (key != IPC_PRIVATE || !this->config.state_path.empty() ||
+          this->config.handoff || this->config.deadlock_check_ns > 0 ||
+          this->config.long_hold_ns > 0))
+    {
+        spdlog::error("The threads backend is private to one process and "
+                      "has no hand-off, deadlock checks or long holds");
+        exit(1);
+    }
+    SemLimits limits = read_sem_limits();
+    this->shard_size = limits.semmsl;
+    if (this->config.threads) {
+        this->shard_size = std::max(1, num_sems);
+    }
+    if (this->config.max_sems_per_set > 0) {
+        this->shard_size =
+          std::min(this->config.max_sems_per_set, this->shard_size);
+    }
+    this->max_semop = limits.semopm;
+    if (this->config.max_ops_per_semop > 0) {
+        this->max_semop =
+          std::min(this->config.max_ops_per_semop, this->max_semop);
+    }
+    int32_t num_shards =
+      std::max(1, (num_sems + this->shard_size - 1) / this->shard_size);
+    if (num_shards > kMaxShards) {
+        spdlog::error("{} semaphores need {} kernel sets of {}, more than {}",
+          num_sems, num_shards, this->shard_size, kMaxShards);
         exit(1);
     }
 
-    semun arg;
-#if __cplusplus >= 201703L
-    for (const auto &[num_id, num_val] : sem_names) {
-        arg.val = num_val;
-        spdlog::trace(
-          "semid: {} num_id: {} num_val: {}", this->semid, num_id, num_val);
-        if (semctl(this->semid, num_id, SETVAL, arg) == -1) {
-            spdlog::error("Error initializing semaphore in {}", __LINE__);
+    /// @note: a set with a key keeps its control block under the same
+    /// key, so semset-top can find it. Private sets only share it by fork.
+    /// It comes first, a key whose set is still in use is refused before
+    /// anything of that set is touched. A new segment or mapping is zero
+    /// already, only a state file of an earlier run has to be cleared
+    bool reused = false, warm = false;
+    if (!this->config.state_path.empty()) {
+        warm = this->map_state_file(reused);
+    }
+    else if (key != IPC_PRIVATE) {
+        int32_t shmid =
+          create_key_segment(key, ControlBlock::size_for(num_sems));
+        void *addr = shmid == -1 ? (void *)-1 : shmat(shmid, nullptr, 0);
+        if (addr == (void *)-1) {
+            spdlog::error("Error creating control block under key {:#x} "
+                          "in {} error {}",
+              key, __LINE__, std::strerror(errno));
+            this->~SemaphoreSet();
+            exit(1);
+        }
+        this->ctrl       = (ControlBlock *)addr;
+        this->ctrl_shmid = shmid;
+    }
+    else {
+        void *addr = mmap(nullptr, ControlBlock::size_for(num_sems),
+          PROT_READ | PROT_WRITE,
+          (this->config.threads ? MAP_PRIVATE : MAP_SHARED) | MAP_ANONYMOUS,
+          -1, 0);
+        if (addr == MAP_FAILED) {
+            spdlog::error("Error mapping control block in {}", __LINE__);
             this->~SemaphoreSet();
-
-            check_semctl_error();
             exit(1);
         }
+        this->ctrl = (ControlBlock *)addr;
+    }
 
-        arg.val = 0; // block_oneself_semid initializing 0
+    /// @note: nothing in use is under the key now, a kernel set still
+    /// there was left by an earlier run and may be smaller than this one
+    if (key != IPC_PRIVATE) {
+        int32_t stale_semid = semget(key, 0, 0);
+        if (stale_semid != -1) {
+            semctl(stale_semid, 0, IPC_RMID);
+        }
+    }
 
-        if (semctl(this->block_oneself_semid, num_id, SETVAL, arg) == -1) {
-            spdlog::error("Error initializing semaphore in {}", __LINE__);
-            this->~SemaphoreSet();
+    /// @note: only the first shard is under the key, the other
+    /// shards are private and their ids live in the control block. The
+    /// park set waits for the first contended Swait outside hand-off mode
+    for (int32_t shard = 0; shard < num_shards && !this->config.threads;
+         ++shard)
+    {
+        int32_t size = std::max(
+          1, std::min(this->shard_size, num_sems - shard * this->shard_size));
+        this->semids.push_back(
+          semget(shard == 0 ? key : IPC_PRIVATE, size, IPC_CREAT | 0666));
 
+        if (this->semids.back() == -1) {
+            spdlog::error("Error creating semaphore set in {}", __LINE__);
+            this->~SemaphoreSet();
             check_semctl_error();
             exit(1);
         }
     }
-#else
+
+    if (this->config.threads) {
+        this->semids.push_back(-1);
+        this->thread_lock = std::make_shared< std::mutex >();
+    }
+
     for (const auto &sem_name : sem_names) {
-        arg.val = sem_name.second;
-        spdlog::trace("semid: {} num_id: {} num_val: {}", this->semid,
-          sem_name.first, sem_name.second);
-        if (semctl(this->semid, sem_name.first, SETVAL, arg) == -1) {
+        if (this->ids.find(sem_name.first) == -1) {
+            spdlog::error("Semaphore id {} is not in the id map",
+              sem_name.first);
+            this->~SemaphoreSet();
+            exit(1);
+        }
+    }
+
+    if (warm) {
+        spdlog::info("Warm restart of {} semaphores from {}", num_sems,
+          this->config.state_path);
+        this->reset_transient_state();
+    }
+    else if (reused) {
+        this->ctrl->ready.store(0);
+        std::fill((char *)this->ctrl,
+          (char *)this->ctrl + ControlBlock::size_for(num_sems), 0);
+    }
+    this->ctrl->magic    = ControlBlock::kMagic;
+    this->ctrl->num_sems = num_sems;
+    this->ctrl->shard_size = this->shard_size;
+    this->ctrl->num_shards = num_shards;
+    this->ctrl->creator    = this->self_pid;
+    std::copy(this->semids.begin(), this->semids.end(), this->ctrl->semids);
+    if (!warm) {
+        for (const auto &sem_name : sem_names) {
+            SemSlot &slot =
+              this->ctrl->sems()[this->ids.find(sem_name.first)];
+            slot.name = sem_name.first;
+            slot.capacity.store(sem_name.second);
+        }
+    }
+
+    /// @note: one SETALL per kernel set. Nothing is held yet, so every
+    /// semaphore starts at its capacity, the one kept from the last run
+    /// on a warm restart
+    std::vector< unsigned short > values(num_shards * this->shard_size);
+    for (int32_t index = 0; index < num_sems; ++index) {
+        values[index] = this->ctrl->sems()[index].capacity.load();
+        spdlog::trace("semid: {} num_id: {} index: {} num_val: {}",
+          this->semid_of(index), this->ids.id_of(index), index,
+          values[index]);
+    }
+    semun arg;
+    for (int32_t index = 0; index < num_sems && this->config.threads;
+         ++index)
+    {
+        this->ctrl->sems()[index].value.store(values[index]);
+    }
+    for (int32_t shard = 0; shard < num_shards && !this->config.threads;
+         ++shard)
+    {
+        arg.array = values.data() + shard * this->shard_size;
+        if (semctl(this->semids[shard], 0, SETALL, arg) == -1) {
             spdlog::error("Error initializing semaphore in {}", __LINE__);
             this->~SemaphoreSet();
             check_semctl_error();
             exit(1);
         }
+    }
 
-        arg.val = 0; // block_oneself_semid initializing 0
+    this->map_trace_ring();
 
-        if (semctl(this->block_oneself_semid, sem_name.first, SETVAL, arg) ==
-            -1)
-        {
-            spdlog::error("Error initializing semaphore in {}", __LINE__);
+    if (this->config.handoff) {
+        /// @note: every waiter slot parks on its own semaphore, so Ssignal
+        /// can wake exactly the process it granted permits to
+        this->park_semid =
+          semget(IPC_PRIVATE, kMaxWaiters + 1, IPC_CREAT | 0666);
+        if (this->park_semid == -1) {
+            spdlog::error("Error creating park semaphore set in {}", __LINE__);
             this->~SemaphoreSet();
+            check_semctl_error();
+            exit(1);
+        }
 
+        unsigned short park_vals[kMaxWaiters + 1] = {};
+        park_vals[this->inner_sem_numid] = 1; // the control block lock
+        arg.array                        = park_vals;
+        if (semctl(this->park_semid, 0, SETALL, arg) == -1) {
+            spdlog::error("Error initializing semaphore in {}", __LINE__);
+            this->~SemaphoreSet();
             check_semctl_error();
             exit(1);
         }
     }
-#endif
+    this->ctrl->park_semid.store(this->park_semid);
+    this->ctrl->handoff    = this->config.handoff;
+    this->ctrl->threads    = this->config.threads;
+    this->construct_ns     = monotonic_ns() - begin_ns;
+    this->ctrl->create_ns  = this->construct_ns;
+
+    /// @note: last, an attaching process waits for it before it reads
+    /// anything else
+    this->ctrl->ready.store(1, std::memory_order_release);
+    this->track_handle();
 }
 
-/// {    sem_nameid  P,v op     min_val
-///     {0,         { -1 ,       1 } }
-/// }
-void SemaphoreSet::Swait(
-  const sem_nameid_min_val_vec_t &sem_op_min_val_vector) {
-    /// @note: when resource release and the process goes out of
-    /// block to continue, we judge the resource again to avoid if
-    /// the resource changed less than 0 during the block period
-    ///
-    /// @note: see the only goto below
-judge_again:
-    // this->mantain_atomic(Psemop);
-
-    /// push the smaller one into what_smaller
-    std::pair< uint16_t, lap::SemIdToReduce > what_block_me;
-    bool is_block = false;
+SemaphoreSet::SemaphoreSet(attach_t, key_t key, SemSetConfig config)
+    : inner_sem_numid(kMaxWaiters), config(config), self_pid(getpid()) {
+    int64_t begin_ns = monotonic_ns();
+    if (key == IPC_PRIVATE && this->config.state_path.empty()) {
+        spdlog::error("A private set can only be shared by fork");
+        exit(1);
+    }
 
-    for (auto &sem_op_with_min_val : sem_op_min_val_vector) {
-        if (semctl(this->semid, sem_op_with_min_val.first, GETVAL) <
-            sem_op_with_min_val.second.min_val)
-        {
-            what_block_me = sem_op_with_min_val;
-            is_block      = true;
+    /// @note: the creator may not be done yet, poll for its control
+    /// block and its ready flag, see ready_and_live
+    int64_t deadline_ns = monotonic_ns() + kAttachTimeoutNs;
+    while (this->ctrl == nullptr && !this->config.state_path.empty()) {
+        if (this->attach_state_file()) {
+            break;
+        }
+        if (monotonic_ns() > deadline_ns) {
+            spdlog::error("No ready semaphore set in {}",
+              this->config.state_path);
+            exit(1);
+        }
+        usleep(1000);
+    }
+    while (this->ctrl == nullptr) {
+        int32_t shmid = shmget(key, 0, 0);
+        void *addr = shmid == -1 ? (void *)-1 : shmat(shmid, nullptr, 0);
+        if (addr != (void *)-1 && ready_and_live((ControlBlock *)addr)) {
+            this->ctrl       = (ControlBlock *)addr;
+            this->ctrl_shmid = shmid;
             break;
         }
+        if (addr != (void *)-1) {
+            shmdt(addr);
+        }
+        if (monotonic_ns() > deadline_ns) {
+            spdlog::error("No ready semaphore set under key {:#x}", key);
+            exit(1);
+        }
+        usleep(1000);
     }
 
-    if (is_block) {
-        (*(this->ptr_record_who_block_me))[what_block_me.first] =
-          what_block_me.first;
-        spdlog::trace("Who Block sem {}'s var :{}", what_block_me.first,
-          (*(this->ptr_record_who_block_me))[what_block_me.first]);
-        this->block_oneself_or_release(what_block_me.first, Psemop);
+    this->num_sems   = this->ctrl->num_sems;
+    this->shard_size = this->ctrl->shard_size;
+    this->semids.assign(
+      this->ctrl->semids, this->ctrl->semids + this->ctrl->num_shards);
+    this->park_semid     = this->ctrl->park_semid.load();
+    this->config.handoff = this->ctrl->handoff != 0;
+    this->held_by.resize(num_sems);
 
-        /// @note: when resource release and the process goes out of
-        /// block to continue, we judge the resource again to avoid if
-        /// the resource changed less than 0 during the block period
-        goto judge_again;
+    std::vector< uint16_t > ids;
+    for (int32_t i = 0; i < num_sems; ++i) {
+        ids.push_back(this->ctrl->sems()[i].name);
     }
-    else {
-        for (auto &sem_op_with_min_val : sem_op_min_val_vector) {
-            if (sem_op_with_min_val.second.sem_op != 0) {
-                /// @note: we have resource to distribute
-                this->sem_operation(
-                  sem_op_with_min_val.first, sem_op_with_min_val.second.sem_op);
-            }
+    this->ids = SemIdMap::in_index_order(std::move(ids));
+
+    this->max_semop = read_sem_limits().semopm;
+    if (this->config.max_ops_per_semop > 0) {
+        this->max_semop =
+          std::min(this->config.max_ops_per_semop, this->max_semop);
+    }
+    this->map_trace_ring();
+    this->construct_ns = monotonic_ns() - begin_ns;
+    this->track_handle();
+}
+
+SemaphoreSet::SemaphoreSet(const SemaphoreSet &other)
+    : num_sems(other.num_sems), inner_sem_numid(other.inner_sem_numid),
+      shard_size(other.shard_size), max_semop(other.max_semop),
+      semids(other.semids), config(other.config),
+      park_semid(other.park_semid), ctrl(other.ctrl),
+      ctrl_shmid(other.ctrl_shmid), trace_ring(other.trace_ring),
+      owns_mappings(false), self_pid(getpid()), thread_lock(other.thread_lock),
+      ids(other.ids), held_by(other.num_sems) {
+    this->track_handle();
+}
+
+SemaphoreSet SemaphoreSet::clone_for_child() const {
+    return SemaphoreSet(*this);
+}
+
+void SemaphoreSet::track_handle() {
+    std::call_once(atfork_once, [] {
+        pthread_atfork(SemaphoreSet::atfork_prepare,
+          SemaphoreSet::atfork_parent, SemaphoreSet::atfork_child);
+    });
+    std::lock_guard< std::mutex > lock(live_handles_mutex);
+    live_handles.push_back(this);
+}
+
+void SemaphoreSet::untrack_handle() {
+    std::lock_guard< std::mutex > lock(live_handles_mutex);
+    auto it = std::find(live_handles.begin(), live_handles.end(), this);
+    if (it != live_handles.end()) {
+        live_handles.erase(it);
+    }
+}
+
+/// @note: whatever spdlog still buffers would otherwise be written by the
+/// parent and the child both
+void SemaphoreSet::atfork_prepare() {
+    spdlog::default_logger_raw()->flush();
+    live_handles_mutex.lock();
+}
+
+void SemaphoreSet::atfork_parent() { live_handles_mutex.unlock(); }
+
+/// @note: the trace ring and the control block are shared on purpose and
+/// stay as they are, only what counts for this process alone starts over
+void SemaphoreSet::atfork_child() {
+    for (SemaphoreSet *handle : live_handles) {
+        handle->reset_process_state();
+    }
+    live_handles_mutex.unlock();
+    reset_call_site_stats();
+}
+
+/// @note: a thread that is gone in the child may have held the lock of
+/// a threads backend set, and none of its sleepers came along
+void SemaphoreSet::reset_process_state() {
+    this->self_pid  = getpid();
+    this->owns_sets = false;
+    std::fill(this->held_by.begin(), this->held_by.end(), HeldBy{});
+    if (this->thread_lock != nullptr) {
+        new (this->thread_lock.get()) std::mutex();
+        for (int32_t index = 0; index < num_sems; ++index) {
+            this->ctrl->sems()[index].sleepers.store(0);
         }
     }
 }
 
-void SemaphoreSet::Ssignal(sem_nameid_t sem_numid, int16_t sem_op) {
-    spdlog::trace("Release find {}, sem {}'s",
-      (*(this->ptr_record_who_block_me))[sem_numid] != -1, sem_numid);
-    if ((*(this->ptr_record_who_block_me))[sem_numid] != -1 &&
-        semctl(this->block_oneself_semid, sem_numid, GETVAL) <= 0)
+bool SemaphoreSet::map_state_file(bool &existed) {
+    /// @note: the state file of a set in use is never taken over
+    if (this->attach_state_file()) {
+        munmap(this->ctrl, ControlBlock::size_for(this->ctrl->num_sems));
+        this->ctrl = nullptr;
+        spdlog::error("State file {} belongs to a set in use",
+          this->config.state_path);
+        exit(1);
+    }
+
+    size_t size = ControlBlock::size_for(num_sems);
+    int32_t fd  = open(
+      this->config.state_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        (st.st_size != (off_t)size && ftruncate(fd, size) == -1))
+    {
+        spdlog::error("Error opening state file {} error {}",
+          this->config.state_path, std::strerror(errno));
+        this->~SemaphoreSet();
+        exit(1);
+    }
+    void *addr =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        spdlog::error("Error mapping state file {} error {}",
+          this->config.state_path, std::strerror(errno));
+        this->~SemaphoreSet();
+        exit(1);
+    }
+    this->ctrl = (ControlBlock *)addr;
+    existed    = st.st_size != 0;
+
+    /// @note: only the state of the very same set is taken over, same
+    /// size, same number of semaphores and the same id at every index
+    if (st.st_size != (off_t)size ||
+        this->ctrl->magic != ControlBlock::kMagic ||
+        this->ctrl->num_sems != num_sems)
+    {
+        return false;
+    }
+    for (int32_t index = 0; index < num_sems; ++index) {
+        if (this->ctrl->sems()[index].name != this->ids.id_of(index)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SemaphoreSet::attach_state_file() {
+    int32_t fd = open(this->config.state_path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        st.st_size < (off_t)sizeof(ControlBlock))
+    {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    void *addr =
+      mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    auto *ctrl = (ControlBlock *)addr;
+    if (ready_and_live(ctrl) &&
+        (size_t)st.st_size == ControlBlock::size_for(ctrl->num_sems))
     {
-        this->block_oneself_or_release(sem_numid, Vsemop);
+        this->ctrl = ctrl;
+        return true;
     }
+    munmap(addr, st.st_size);
+    return false;
+}
 
-    this->sem_operation(sem_numid, sem_op);
-    spdlog::trace(
-      "After Release sem {}'s value: {}", sem_numid, getVal(sem_numid));
+void SemaphoreSet::reset_transient_state() {
+    /// @note: every process of the last run is gone, with it whatever it
+    /// held, waited for or leased. Capacities, names and stats stay
+    this->ctrl->ready.store(0);
+    std::fill((char *)this->ctrl->waiters,
+      (char *)(this->ctrl->waiters + kMaxWaiters), 0);
+    std::fill((char *)this->ctrl->leases,
+      (char *)(this->ctrl->leases + kMaxLeases), 0);
+    this->ctrl->num_waiters.store(0);
+    this->ctrl->live_leases.store(0);
+    this->ctrl->last_long_hold_warn_ns.store(0);
+    for (int32_t index = 0; index < num_sems; ++index) {
+        SemSlot &slot = this->ctrl->sems()[index];
+        slot.reserved = 0;
+        slot.debt.store(0);
+        slot.num_holders.store(0);
+        std::fill((char *)slot.holders,
+          (char *)(slot.holders + kMaxHolders), 0);
+    }
 }
 
-int32_t SemaphoreSet::getSemid() const { return this->semid; }
+int32_t SemaphoreSet::park_semid_of(bool create) {
+    /// @note: only the parking thread fills the cache, wakers may run on
+    /// another thread, see HolderReaper
+    if (this->config.handoff) {
+        return this->park_semid;
+    }
+    if (!create) {
+        return this->ctrl->park_semid.load();
+    }
+    if (this->park_semid != -1) {
+        return this->park_semid;
+    }
 
-int32_t SemaphoreSet::getVal(sem_nameid_t sem_numid) const {
-    return semctl(this->semid, sem_numid, GETVAL);
+    int32_t park_semid = this->ctrl->park_semid.load();
+    if (park_semid == -1) {
+        /// @note: a new set starts at 0 on Linux, which is what the
+        /// wake tokens need. Whoever loses the race drops its own set
+        int32_t created =
+          semget(IPC_PRIVATE, kMaxWaiters + 1, IPC_CREAT | 0666);
+        if (created == -1) {
+            spdlog::error("Error creating park semaphore set in {}", __LINE__);
+            check_semctl_error();
+        }
+        if (this->ctrl->park_semid.compare_exchange_strong(
+              park_semid, created))
+        {
+            park_semid = created;
+        }
+        else {
+            semctl(created, 0, IPC_RMID);
+        }
+    }
+    this->park_semid = park_semid;
+    return park_semid;
 }
 
-SemaphoreSet::~SemaphoreSet() {
-    munmap((*ptr_record_who_block_me), num_sems * sizeof(int16_t));
-    delete ptr_record_who_block_me;
+void SemaphoreSet::map_trace_ring() {
+    if (this->config.trace_capacity == 0) {
+        return;
+    }
+    uint32_t capacity = 1;
+    while (capacity < this->config.trace_capacity) {
+        capacity <<= 1;
+    }
+    this->trace_ring = (TraceRing *)mmap(nullptr,
+      TraceRing::size_for(capacity), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (this->trace_ring == MAP_FAILED) {
+        spdlog::error("Error mapping trace ring in {}", __LINE__);
+        this->trace_ring = nullptr;
+        this->~SemaphoreSet();
+        exit(1);
+    }
+    this->trace_ring->magic    = TraceRing::kMagic;
+    this->trace_ring->capacity = capacity;
+}
+
+void SemaphoreSet::mantain_atomic(int16_t sem_op) {
+    sembuf ops = {(unsigned short)this->inner_sem_numid, sem_op, SEM_UNDO};
+    if (semop(this->park_semid, &ops, 1) == -1) {
+        spdlog::error("Error locking control block happen in {}", __LINE__);
+        exit(1);
+    }
+}
+
+int32_t SemaphoreSet::shard_semop(
+  const std::vector< int32_t > &sets, sembuf *ops, int32_t num_ops) {
+    int32_t set_id = sets[ops[0].sem_num / this->shard_size];
+    for (int32_t i = 0; i < num_ops; ++i) {
+        ops[i].sem_num = this->index_of(ops[i].sem_num);
+    }
+    return semop(set_id, ops, num_ops);
+}
+
+/// @note: the kernel is only atomic within one semop on one set. When a
+/// request spans shards or exceeds SEMOPM, the ops of every semaphore are
+/// folded into the lowest point they reach and their net change. The
+/// takes go first, chunk by chunk, and whatever was taken is given back
+/// when a chunk fails. Gains go last, so a rollback never has to take
+/// anything away from another process
+int32_t SemaphoreSet::request_semop(sembuf *ops, int32_t num_ops) {
+    if (this->semids.size() == 1 && num_ops <= this->max_semop) {
+        return semop(this->semids[0], ops, num_ops);
+    }
+
+    struct Folded {
+        unsigned short sem_num;
+        short flags;
+        int32_t low; // lowest running sum of its ops, never above 0
+        int32_t net;
+    };
+    std::vector< Folded > folded;
+    for (int32_t i = 0; i < num_ops; ++i) {
+        auto it = std::find_if(folded.begin(), folded.end(),
+          [&](const Folded &f) { return f.sem_num == ops[i].sem_num; });
+        if (it == folded.end()) {
+            folded.push_back({ops[i].sem_num, ops[i].sem_flg, 0, 0});
+            it = folded.end() - 1;
+        }
+        it->net += ops[i].sem_op;
+        it->low = std::min(it->low, it->net);
+    }
+    std::sort(folded.begin(), folded.end(),
+      [](const Folded &a, const Folded &b) { return a.sem_num < b.sem_num; });
+
+    /// @note: apply `bufs` one shard and at most max_semop ops at a time,
+    /// the two ops of a semaphore stay in the same chunk. Returns how many
+    /// went through
+    auto apply = [&](std::vector< sembuf > &bufs) -> size_t {
+        size_t begin = 0;
+        while (begin < bufs.size()) {
+            int32_t shard = bufs[begin].sem_num / this->shard_size;
+            size_t end    = begin;
+            while (end < bufs.size() &&
+                   bufs[end].sem_num / this->shard_size == shard &&
+                   end - begin < (size_t)this->max_semop)
+            {
+                ++end;
+            }
+            if (end < bufs.size() && end > begin + 1 &&
+                bufs[end].sem_num == bufs[end - 1].sem_num)
+            {
+                --end;
+            }
+            std::vector< sembuf > chunk(bufs.begin() + begin,
+              bufs.begin() + end);
+            if (this->shard_semop(this->semids, chunk.data(), chunk.size()) ==
+                -1)
+            {
+                return begin;
+            }
+            begin = end;
+        }
+        return bufs.size();
+    };
+
+    std::vector< sembuf > takes, gains;
+    for (auto &f : folded) {
+        int32_t kept = std::min(f.net, 0);
+        if (f.low < 0) {
+            takes.push_back({f.sem_num, (short)f.low, f.flags});
+        }
+        if (kept != f.low) {
+            takes.push_back({f.sem_num, (short)(kept - f.low), f.flags});
+        }
+        if (f.net > 0) {
+            gains.push_back({f.sem_num, (short)f.net, f.flags});
+        }
+    }
+
+    size_t taken = apply(takes);
+    if (taken < takes.size()) {
+        int32_t saved_errno = errno;
+        for (size_t i = 0; i < taken; ++i) {
+            if (i + 1 < taken && takes[i + 1].sem_num == takes[i].sem_num) {
+                continue; // the net of a semaphore is in its last op
+            }
+            auto f = std::find_if(folded.begin(), folded.end(),
+              [&](const Folded &other) {
+                  return other.sem_num == takes[i].sem_num;
+              });
+            if (f->net >= 0) {
+                continue;
+            }
+            sembuf back = {f->sem_num, (short)-f->net,
+              (short)(f->flags & ~IPC_NOWAIT)};
+            if (this->shard_semop(this->semids, &back, 1) == -1) {
+                spdlog::error("Error rolling back a request happen in {}",
+                  __LINE__);
+                exit(1);
+            }
+            if (!this->config.handoff) {
+                this->wake_parked(f->sem_num);
+            }
+        }
+        errno = saved_errno;
+        return -1;
+    }
+    return apply(gains) == gains.size() ? 0 : -1;
+}
+
+int32_t SemaphoreSet::find_blocker(
+  const sem_nameid_min_val_vec_t &sem_op_min_val_vector) {
+    for (auto &sem_op_with_min_val : sem_op_min_val_vector) {
+        sem_nameid_t sem_numid = sem_op_with_min_val.first;
+        int32_t avail =
+          semctl(this->semid_of(sem_numid), this->index_of(sem_numid), GETVAL) -
+          this->ctrl->sems()[sem_numid].reserved;
+        if (avail < needed_value(sem_op_with_min_val.second.min_val,
+                      sem_op_with_min_val.second.sem_op))
+        {
+            return sem_op_with_min_val.first;
+        }
+    }
+    return -1;
+}
+
+/// @note: apply every op of one request in a single semop, `reserved`
+/// means the permits were set aside for us by grant_waiters
+void SemaphoreSet::apply_ops(const WaitOp *ops, int32_t num_ops,
+  bool reserved, int64_t wait_begin_ns, CallSiteStats *caller) {
+    sembuf bufs[kMaxWaitOps];
+    int32_t num_bufs = 0;
+    for (int32_t i = 0; i < num_ops; ++i) {
+        if (ops[i].sem_op == 0) {
+            continue;
+        }
+        bufs[num_bufs++] = {ops[i].sem_numid, ops[i].sem_op, SEM_UNDO};
+        if (ops[i].sem_op < 0) {
+            this->note_acquired(ops[i].sem_numid, -ops[i].sem_op,
+              wait_begin_ns, reserved ? TRACE_WOKEN : TRACE_FAST, caller);
+        }
+        if (reserved && ops[i].sem_op < 0) {
+            this->ctrl->sems()[ops[i].sem_numid].reserved += ops[i].sem_op;
+        }
+    }
+    if (num_bufs > 0 && this->request_semop(bufs, num_bufs) == -1) {
+        spdlog::error("Error applying hand-off ops happen in {}", __LINE__);
+        exit(1);
+    }
+}
+
+/// @note: walk the parked processes oldest first and reserve permits for
+/// every one whose whole request fits into what is left. An entry that
+/// needs more than it takes, a sem_op of 0 with a min_val, leaves that
+/// much as a floor no younger waiter of the same walk may take from.
+/// Outside the walk nothing guards it, see grant_holds
+///
+/// @note: a waiter that does not fit yet leaves what it needs of every
+/// semaphore it names as a floor too, younger ones only take what is
+/// above it. Otherwise they would keep taking the permits it waits to
+/// build up and it would starve. A younger waiter that holds some of a
+/// semaphore the older one is short of is not held back by it, the
+/// older one may be waiting for exactly what it holds
+void SemaphoreSet::grant_waiters() {
+    if (this->ctrl->num_waiters.load() == 0) {
+        return;
+    }
+    WaiterSlot *order[kMaxWaiters];
+    int32_t num_parked = 0;
+    for (auto &waiter : this->ctrl->waiters) {
+        if (waiter.pid != 0 && !waiter.granted && !waiter.aborted) {
+            order[num_parked++] = &waiter;
+        }
+    }
+    if (num_parked == 0) {
+        return;
+    }
+    std::sort(order, order + num_parked,
+      [](const WaiterSlot *a, const WaiterSlot *b) {
+          return a->ticket < b->ticket;
+      });
+
+    /// @note: only the semaphores the parked requests name, read with one
+    /// GETALL per kernel set they are in
+    struct Avail {
+        sem_nameid_t sem_numid;
+        int32_t avail;
+        int32_t floor;
+    };
+    std::vector< Avail > sems;
+    for (int32_t i = 0; i < num_parked; ++i) {
+        for (int32_t j = 0; j < order[i]->num_ops; ++j) {
+            sems.push_back({order[i]->ops[j].sem_numid, 0, 0});
+        }
+    }
+    std::sort(sems.begin(), sems.end(), [](const Avail &a, const Avail &b) {
+        return a.sem_numid < b.sem_numid;
+    });
+    sems.erase(std::unique(sems.begin(), sems.end(),
+                 [](const Avail &a, const Avail &b) {
+                     return a.sem_numid == b.sem_numid;
+                 }),
+      sems.end());
+    std::vector< unsigned short > vals(this->shard_size);
+    int32_t shard = -1;
+    for (auto &sem : sems) {
+        if (sem.sem_numid / this->shard_size != shard) {
+            shard = sem.sem_numid / this->shard_size;
+            if (!get_shard_values(this->ctrl, shard, vals.data())) {
+                check_semctl_error();
+            }
+        }
+        sem.avail = vals[this->index_of(sem.sem_numid)] -
+                    this->ctrl->sems()[sem.sem_numid].reserved;
+    }
+    auto sem_of = [&](const WaitOp &op) -> Avail & {
+        return *std::lower_bound(sems.begin(), sems.end(), op.sem_numid,
+          [](const Avail &a, sem_nameid_t sem_numid) {
+              return a.sem_numid < sem_numid;
+          });
+    };
+
+    /// @note: the older waiters that did not fit, and per waiter a bit
+    /// for every entry it was short of
+    WaiterSlot *passed[kMaxWaiters];
+    uint32_t short_of[kMaxWaiters];
+    int32_t num_passed = 0;
+
+    /// @note: how much of `op`'s semaphore `waiter` has to leave to the
+    /// older waiters that did not fit. Not for an older one short of a
+    /// semaphore `waiter` holds, it may be waiting for exactly that
+    auto held_back = [&](const WaiterSlot *waiter, const WaitOp &op) {
+        int32_t floor = 0;
+        for (int32_t p = 0; p < num_passed; ++p) {
+            bool holds = false;
+            for (int32_t k = 0; k < passed[p]->num_ops && !holds; ++k) {
+                holds = (short_of[p] >> k & 1) != 0 &&
+                        this->find_holder(passed[p]->ops[k].sem_numid,
+                          waiter->pid) != nullptr;
+            }
+            for (int32_t k = 0; k < passed[p]->num_ops && !holds; ++k) {
+                const WaitOp &older = passed[p]->ops[k];
+                if (older.sem_numid == op.sem_numid) {
+                    floor = std::max(
+                      floor, needed_value(older.min_val, older.sem_op));
+                }
+            }
+        }
+        return floor;
+    };
+
+    for (int32_t i = 0; i < num_parked; ++i) {
+        WaiterSlot *waiter = order[i];
+        uint32_t short_ops = 0;
+        for (int32_t j = 0; j < waiter->num_ops; ++j) {
+            const WaitOp &op = waiter->ops[j];
+            Avail &sem       = sem_of(op);
+            bool fits = sem.avail >= needed_value(op.min_val, op.sem_op);
+            if (fits && op.sem_op < 0) {
+                fits = sem.avail + op.sem_op >=
+                       std::max(sem.floor, held_back(waiter, op));
+            }
+            short_ops |= fits ? 0 : 1u << j;
+        }
+        if (short_ops != 0) {
+            passed[num_passed]     = waiter;
+            short_of[num_passed++] = short_ops;
+            continue;
+        }
+
+        for (int32_t j = 0; j < waiter->num_ops; ++j) {
+            const WaitOp &op = waiter->ops[j];
+            Avail &sem       = sem_of(op);
+            int32_t take     = std::max< int32_t >(-op.sem_op, 0);
+            sem.avail -= take;
+            sem.floor = std::max(
+              sem.floor, needed_value(op.min_val, op.sem_op) - take);
+            this->ctrl->sems()[op.sem_numid].reserved += take;
+        }
+        waiter->granted = 1;
+
+        /// @note: no SEM_UNDO, the +1 is consumed by the waiter
+        sembuf wake = {
+          (unsigned short)(waiter - this->ctrl->waiters), Vsemop, 0};
+        if (semop(this->park_semid, &wake, 1) == -1) {
+            spdlog::error("Error waking waiter happen in {}", __LINE__);
+            exit(1);
+        }
+    }
+}
+
+/// @note: hand-off mode, requires the control block lock. The permits a
+/// grant reserved stay reserved, but what an entry needs beyond them is
+/// only checked. Whoever took permits since may have broken that
+bool SemaphoreSet::grant_holds(const WaiterSlot &waiter) {
+    for (int32_t i = 0; i < waiter.num_ops; ++i) {
+        const WaitOp &op = waiter.ops[i];
+        int32_t needed   = needed_value(op.min_val, op.sem_op);
+        if (needed <= -op.sem_op) {
+            continue;
+        }
+        /// @note: the reservations of this very request count as ours
+        int32_t avail = this->value_of(op.sem_numid) -
+                        this->ctrl->sems()[op.sem_numid].reserved;
+        for (int32_t j = 0; j < waiter.num_ops; ++j) {
+            if (waiter.ops[j].sem_numid == op.sem_numid &&
+                waiter.ops[j].sem_op < 0)
+            {
+                avail -= waiter.ops[j].sem_op;
+            }
+        }
+        if (avail < needed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @note: hand-off mode, requires the control block lock. The waiter
+/// keeps its slot and with it its place in line
+void SemaphoreSet::revoke_grant(WaiterSlot &waiter) {
+    for (int32_t i = 0; i < waiter.num_ops; ++i) {
+        if (waiter.ops[i].sem_op < 0) {
+            this->ctrl->sems()[waiter.ops[i].sem_numid].reserved +=
+              waiter.ops[i].sem_op;
+        }
+    }
+    waiter.granted = 0;
+}
+
+bool SemaphoreSet::handoff_wait(
+  const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+  int64_t wait_begin_ns, CallSiteStats *caller) {
+    if (sem_op_min_val_vector.size() > (size_t)kMaxWaitOps) {
+        spdlog::error("Swait with more than {} semaphores can not be "
+                      "handed off",
+          kMaxWaitOps);
+        exit(1);
+    }
+
+    WaitOp ops[kMaxWaitOps];
+    int32_t num_ops = 0;
+    for (auto &sem_op_with_min_val : sem_op_min_val_vector) {
+        ops[num_ops++] = {sem_op_with_min_val.first,
+          (int16_t)sem_op_with_min_val.second.sem_op,
+          sem_op_with_min_val.second.min_val};
+    }
+
+    int32_t slot = -1;
+    while (slot == -1) {
+        this->mantain_atomic(Psemop);
+        int32_t blocker = this->find_blocker(sem_op_min_val_vector);
+        if (blocker != -1 && this->ctrl->sems()[blocker].reserved > 0 &&
+            this->reap_dead_waiters() > 0)
+        {
+            /// @note: permits granted to a dead waiter are free again
+            blocker = this->find_blocker(sem_op_min_val_vector);
+        }
+        if (blocker == -1 && this->ctrl->num_waiters.load() == 0) {
+            this->apply_ops(ops, num_ops, false, wait_begin_ns, caller);
+            inject_fault(FAULT_LOCKED, ops[0].sem_numid);
+            this->mantain_atomic(Vsemop);
+            return true;
+        }
+
+        /// @note: while others wait, a request that fits still queues up
+        /// behind them and is served by the walk, which may hold back
+        /// permits for an older waiter. Granted at once, it finds its
+        /// wake-up posted and does not sleep
+        slot = this->enter_waiters(blocker != -1 ? blocker : ops[0].sem_numid);
+        if (slot != -1) {
+            WaiterSlot &waiter = this->ctrl->waiters[slot];
+            waiter.num_ops     = num_ops;
+            std::copy(ops, ops + num_ops, waiter.ops);
+            if (blocker == -1) {
+                this->grant_waiters();
+            }
+            if (!waiter.granted) {
+                this->note_parked(waiter.blocked_on, caller);
+            }
+        }
+        else {
+            this->reap_dead_waiters();
+        }
+        this->mantain_atomic(Vsemop);
+
+        if (slot != -1) {
+            inject_fault(FAULT_WAIT_BLOCKED, blocker);
+        }
+        else {
+            /// @note: every slot is taken, let the parked ones drain first
+            sched_yield();
+        }
+    }
+
+    /// @note: the reserved permits are ours once we are woken, an entry
+    /// that only checks min_val is judged again under the lock
+    WaiterSlot &waiter = this->ctrl->waiters[slot];
+    while (true) {
+        while (!this->park(
+          this->park_semid, {(unsigned short)slot, Psemop, 0}))
+        {
+            this->on_park_timeout(waiter.blocked_on);
+        }
+        inject_fault(FAULT_WAIT_WOKEN, waiter.blocked_on);
+
+        this->mantain_atomic(Psemop);
+        inject_fault(FAULT_LOCKED, ops[0].sem_numid);
+        if (!waiter.granted || this->grant_holds(waiter)) {
+            break;
+        }
+        this->revoke_grant(waiter);
+        this->grant_waiters();
+        this->mantain_atomic(Vsemop);
+    }
+    bool granted = waiter.granted;
+    if (granted) {
+        this->apply_ops(ops, num_ops, true, wait_begin_ns, caller);
+    }
+    else {
+        this->trace(TRACE_ABORT, ops[0].sem_numid, 0);
+    }
+    this->leave_waiters(waiter);
+    this->mantain_atomic(Vsemop);
+    return granted;
+}
+
+/// {    sem_nameid  P,v op     min_val
+///     {0,         { -1 ,       1 } }
+/// }
+sem_nameid_t SemaphoreSet::resolve(sem_nameid_t sem_numid) const {
+    int32_t index = this->ids.find(sem_numid);
+    if (index == -1) {
+        spdlog::error("Semaphore id {} is not in the set", sem_numid);
+        exit(1);
+    }
+    return index;
+}
+
+const sem_nameid_min_val_vec_t &SemaphoreSet::resolve(
+  const sem_nameid_min_val_vec_t &request,
+  sem_nameid_min_val_vec_t &scratch) const {
+    if (this->ids.is_dense()) {
+        for (auto &sem_op_with_min_val : request) {
+            this->resolve(sem_op_with_min_val.first);
+        }
+        return request;
+    }
+    scratch.clear();
+    scratch.reserve(request.size());
+    for (auto &sem_op_with_min_val : request) {
+        scratch.push_back({this->resolve(sem_op_with_min_val.first),
+          sem_op_with_min_val.second});
+    }
+    return scratch;
+}
+
+bool SemaphoreSet::Swait(
+  const sem_nameid_min_val_vec_t &sem_op_min_val_vector, CallSite site) {
+    sem_nameid_min_val_vec_t scratch;
+    return this->wait(this->resolve(sem_op_min_val_vector, scratch), site);
+}
+
+bool SemaphoreSet::wait(
+  const sem_nameid_min_val_vec_t &sem_op_min_val_vector, CallSite site) {
+    CallSiteStats *caller = call_site_stats(site);
+    if (!sem_op_min_val_vector.empty()) {
+        this->trace(TRACE_WAIT_BEGIN, sem_op_min_val_vector.front().first,
+          (int32_t)sem_op_min_val_vector.size());
+    }
+    if (this->config.threads) {
+        return this->thread_wait(sem_op_min_val_vector, caller);
+    }
+
+    int64_t wait_begin_ns = monotonic_ns();
+    this->reclaim_expired_leases();
+    bool acquired;
+    if (this->config.handoff) {
+        acquired =
+          this->handoff_wait(sem_op_min_val_vector, wait_begin_ns, caller);
+    }
+    else {
+        acquired =
+          this->legacy_wait(sem_op_min_val_vector, wait_begin_ns, caller);
+    }
+    if (acquired) {
+        caller->record_wait(monotonic_ns() - wait_begin_ns);
+    }
+    return acquired;
+}
+
+/// @note: the whole request is one semop, so it is taken all at once or
+/// not at all. When it is short the process publishes the semaphore that
+/// blocks it, checks that one again and only then parks, so a Ssignal
+/// in between either is seen here or sees us, see wake_parked
+bool SemaphoreSet::legacy_wait(
+  const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+  int64_t wait_begin_ns, CallSiteStats *caller) {
+    /// @note: an entry checks value >= min_val by taking and giving back
+    /// what it needs, the kernel does every op in order and atomically
+    std::vector< sembuf > bufs;
+    for (auto &[sem_numid, to_reduce] : sem_op_min_val_vector) {
+        int32_t need = needed_value(to_reduce.min_val, to_reduce.sem_op);
+        if (need > 0) {
+            bufs.push_back({sem_numid, (short)-need, SEM_UNDO | IPC_NOWAIT});
+        }
+        if (need + to_reduce.sem_op != 0) {
+            bufs.push_back({sem_numid, (short)(need + to_reduce.sem_op),
+              SEM_UNDO | IPC_NOWAIT});
+        }
+    }
+
+    int32_t slot = -1; // our entry in the waiter table once we park
+    while (true) {
+        if (bufs.empty() ||
+            this->request_semop(bufs.data(), bufs.size()) == 0)
+        {
+            break;
+        }
+        if (errno != EAGAIN && errno != EINTR) {
+            spdlog::error("Error waiting on semaphores happen in {}", __LINE__);
+            exit(1);
+        }
+
+        int32_t blocker = -1;
+        int32_t need    = 0;
+        for (auto &[sem_numid, to_reduce] : sem_op_min_val_vector) {
+            need = needed_value(to_reduce.min_val, to_reduce.sem_op);
+            if (this->value_of(sem_numid) < need) {
+                blocker = sem_numid;
+                break;
+            }
+        }
+        if (blocker == -1) {
+            continue; // released meanwhile
+        }
+        inject_fault(FAULT_WAIT_SHORT, blocker);
+
+        /// @note: before we show up in the waiter table, a Ssignal that
+        /// sees us has to find the set to wake us on
+        this->park_semid_of(true);
+        if (slot == -1) {
+            slot = this->enter_waiters(blocker);
+            if (slot == -1) {
+                /// @note: every slot is taken, a Ssignal could not find
+                /// us, so let the parked ones drain first
+                this->reap_dead_waiters();
+                sched_yield();
+                continue;
+            }
+            /// @note: for detect_deadlocks only, which takes a request
+            /// too long to keep as short on every semaphore it waits on
+            WaiterSlot &waiter = this->ctrl->waiters[slot];
+            if (sem_op_min_val_vector.size() <= (size_t)kMaxWaitOps) {
+                for (auto &[sem_numid, to_reduce] : sem_op_min_val_vector) {
+                    waiter.ops[waiter.num_ops++] = {sem_numid,
+                      (int16_t)to_reduce.sem_op, to_reduce.min_val};
+                }
+            }
+        }
+        else {
+            this->ctrl->waiters[slot].blocked_on.store(blocker);
+        }
+        if (this->value_of(blocker) >= need) {
+            continue;
+        }
+
+        this->note_parked(blocker, caller);
+        inject_fault(FAULT_WAIT_BLOCKED, blocker);
+        if (this->ctrl->live_leases.load() == 0 &&
+            this->config.deadlock_check_ns == 0 &&
+            this->config.long_hold_ns == 0)
+        {
+            this->block_oneself_or_release(slot, Psemop);
+        }
+        else if (!this->park(
+                   this->park_semid, {(unsigned short)slot, Psemop, 0}))
+        {
+            this->on_park_timeout(blocker);
+        }
+        inject_fault(FAULT_WAIT_WOKEN, blocker);
+
+        if (this->ctrl->waiters[slot].aborted) {
+            this->leave_waiters(this->ctrl->waiters[slot]);
+            this->trace(TRACE_ABORT, blocker, 0);
+            return false;
+        }
+    }
+
+    if (!sem_op_min_val_vector.empty()) {
+        inject_fault(FAULT_WAIT_ACQUIRED, sem_op_min_val_vector.front().first);
+    }
+    for (auto &[sem_numid, to_reduce] : sem_op_min_val_vector) {
+        if (to_reduce.sem_op < 0) {
+            this->note_acquired(sem_numid, -to_reduce.sem_op, wait_begin_ns,
+              slot == -1 ? TRACE_FAST : TRACE_WOKEN, caller);
+        }
+        else if (to_reduce.sem_op > 0) {
+            this->wake_parked(sem_numid);
+        }
+    }
+    if (slot != -1) {
+        this->leave_waiters(this->ctrl->waiters[slot]);
+    }
+    return true;
+}
+
+/// @note: claim up to `want` permits of a pending shrink
+static int32_t claim_debt(std::atomic< int32_t > &debt, int32_t want) {
+    int32_t owed = debt.load();
+    while (owed > 0) {
+        int32_t take = std::min(owed, want);
+        if (debt.compare_exchange_weak(owed, owed - take)) {
+            return take;
+        }
+    }
+    return 0;
+}
+
+void SemaphoreSet::Ssignal(sem_nameid_t sem_numid, int16_t sem_op) {
+    this->signal(this->resolve(sem_numid), sem_op);
+}
+
+void SemaphoreSet::signal(sem_nameid_t sem_numid, int16_t sem_op) {
+    if (this->config.threads) {
+        this->trace(TRACE_SIGNAL, sem_numid, sem_op);
+        if (sem_op > 0) {
+            sem_op -= claim_debt(this->ctrl->sems()[sem_numid].debt, sem_op);
+        }
+        this->thread_signal(sem_numid, sem_op);
+        return;
+    }
+    this->note_released(sem_numid, sem_op);
+    this->note_holder(sem_numid, -sem_op, this->self_pid);
+    this->trace(TRACE_SIGNAL, sem_numid, sem_op);
+    inject_fault(FAULT_SIGNAL, sem_numid);
+
+    /// @note: a pending shrink swallows the released permits, the undo
+    /// value of the caller is still balanced by the SEM_UNDO half
+    int32_t swallowed =
+      claim_debt(this->ctrl->sems()[sem_numid].debt, sem_op);
+    if (swallowed > 0) {
+        sembuf ops[2] = {
+          {sem_numid, sem_op,             SEM_UNDO},
+          {sem_numid, (short)-swallowed, 0       }
+        };
+        if (this->shard_semop(this->semids, ops, 2) == -1) {
+            spdlog::error("Error signaling semaphore  happen in {}", __LINE__);
+            exit(1);
+        }
+        if (swallowed == sem_op) {
+            return;
+        }
+    }
+
+    if (this->config.handoff) {
+        this->mantain_atomic(Psemop);
+        inject_fault(FAULT_LOCKED, sem_numid);
+        if (swallowed == 0) {
+            this->sem_operation(sem_numid, sem_op);
+        }
+        this->grant_waiters();
+        this->mantain_atomic(Vsemop);
+        return;
+    }
+
+    if (swallowed == 0) {
+        this->sem_operation(sem_numid, sem_op);
+    }
+    inject_fault(FAULT_SIGNAL_RELEASED, sem_numid);
+    this->wake_parked(sem_numid);
+}
+
+/// @note: call it after the permits are back. Every process that parks
+/// on `sem_numid` publishes it first and checks the value after, so it
+/// either sees the permits or is counted here. Each one parks on the
+/// semaphore of its own waiter slot, which only gets a token when it has
+/// none, so a process that got through without parking leaves at most
+/// one spurious wake-up behind
+///
+/// @note: a parking process counts itself in num_waiters before it
+/// checks the value, so 0 here means nobody can have missed the permits
+void SemaphoreSet::wake_parked(sem_nameid_t sem_numid) {
+    if (this->ctrl->num_waiters.load() == 0) {
+        return;
+    }
+    int32_t parked[kMaxWaiters];
+    int32_t num_parked = 0;
+    for (int32_t slot = 0; slot < kMaxWaiters; ++slot) {
+        WaiterSlot &waiter = this->ctrl->waiters[slot];
+        if (waiter.pid.load() != 0 && waiter.blocked_on.load() == sem_numid) {
+            parked[num_parked++] = slot;
+        }
+    }
+    int32_t park_semid = this->park_semid_of(false);
+    if (num_parked == 0 || park_semid == -1) {
+        return;
+    }
+
+    unsigned short tokens[kMaxWaiters + 1];
+    semun arg;
+    arg.array = tokens;
+    if (semctl(park_semid, 0, GETALL, arg) == -1) {
+        spdlog::error("Error waking parked processes happen in {}", __LINE__);
+        exit(1);
+    }
+    sembuf wake[kMaxWaiters];
+    int32_t num_wake = 0;
+    for (int32_t i = 0; i < num_parked; ++i) {
+        if (tokens[parked[i]] == 0) {
+            wake[num_wake++] = {(unsigned short)parked[i], Vsemop, 0};
+        }
+    }
+    for (int32_t done = 0; done < num_wake; done += this->max_semop) {
+        if (semop(park_semid, wake + done,
+              std::min(num_wake - done, this->max_semop)) == -1)
+        {
+            spdlog::error("Error waking parked processes happen in {}",
+              __LINE__);
+            exit(1);
+        }
+    }
+}
+
+int32_t SemaphoreSet::adjust_capacity(sem_nameid_t sem_numid, int16_t delta) {
+    return this->adjust(this->resolve(sem_numid), delta);
+}
+
+int32_t SemaphoreSet::adjust(sem_nameid_t sem_numid, int16_t delta) {
+    if (delta == 0) {
+        return 0;
+    }
+    if (this->config.threads) {
+        return this->thread_adjust(sem_numid, delta);
+    }
+
+    if (this->config.handoff) {
+        this->mantain_atomic(Psemop);
+    }
+
+    int32_t applied = 0;
+    if (delta > 0) {
+        sembuf ops = {sem_numid, delta, 0};
+        if (this->shard_semop(this->semids, &ops, 1) == -1) {
+            spdlog::error("Error growing semaphore happen in {}", __LINE__);
+            exit(1);
+        }
+        applied = delta;
+
+        if (this->config.handoff) {
+            this->grant_waiters();
+        }
+        else {
+            this->wake_parked(sem_numid);
+        }
+    }
+    else {
+        /// @note: never block here, whatever is held stays with its holder
+        while (applied == 0) {
+            int32_t avail = this->value_of(sem_numid);
+            if (this->config.handoff) {
+                avail -= this->ctrl->sems()[sem_numid].reserved;
+            }
+            int16_t take = (int16_t)std::min< int32_t >(-delta, avail);
+            if (take <= 0) {
+                break;
+            }
+
+            sembuf ops = {sem_numid, (short)-take, IPC_NOWAIT};
+            if (this->shard_semop(this->semids, &ops, 1) == 0) {
+                applied = -take;
+            }
+            else if (errno != EAGAIN) {
+                spdlog::error(
+                  "Error shrinking semaphore happen in {}", __LINE__);
+                exit(1);
+            }
+        }
+    }
+
+    if (this->config.handoff) {
+        this->mantain_atomic(Vsemop);
+    }
+    return applied;
+}
+
+HolderSlot *SemaphoreSet::find_holder(sem_nameid_t sem_numid, pid_t pid) {
+    SemSlot &sem      = this->ctrl->sems()[sem_numid];
+    HolderSlot *&last = this->held_by[sem_numid].holder;
+    bool mine         = pid == this->self_pid;
+    if (mine && last != nullptr &&
+        last->pid.load(std::memory_order_relaxed) == pid)
+    {
+        return last;
+    }
+    if (sem.num_holders.load() == 0) {
+        return nullptr;
+    }
+    for (auto &holder : sem.holders) {
+        if (holder.pid.load(std::memory_order_relaxed) == pid) {
+            if (mine) {
+                last = &holder;
+            }
+            return &holder;
+        }
+    }
+    return nullptr;
+}
+
+HolderSlot *SemaphoreSet::note_holder(
+  sem_nameid_t sem_numid, int32_t permits, pid_t pid) {
+    SemSlot &sem       = this->ctrl->sems()[sem_numid];
+    HolderSlot *holder = this->find_holder(sem_numid, pid);
+    if (holder != nullptr) {
+        if (holder->count.fetch_add(permits) + permits <= 0) {
+            holder->count.store(0);
+            holder->since_ns.store(0);
+            holder->pid.store(0);
+            sem.num_holders.fetch_sub(1);
+            return nullptr;
+        }
+        return holder;
+    }
+    if (permits <= 0) {
+        return nullptr;
+    }
+
+    /// @note: when more processes hold it than we have slots, the extra
+    /// ones are simply missing from the wait-for graph. Counted before the
+    /// claim, a process dying in between leaves the count too high only
+    sem.num_holders.fetch_add(1);
+    for (auto &slot : sem.holders) {
+        pid_t expected = 0;
+        if (slot.pid.compare_exchange_strong(expected, pid)) {
+            slot.count.store(permits);
+            if (pid == this->self_pid) {
+                this->held_by[sem_numid].holder = &slot;
+            }
+            return &slot;
+        }
+    }
+    sem.num_holders.fetch_sub(1);
+    return nullptr;
+}
+
+/// "file:line" of `site` without the directories
+static void format_site(
+  char (&buf)[kHolderSiteLen], const CallSiteStats *site) {
+    const char *file = std::strrchr(site->file, '/');
+    std::snprintf(buf, kHolderSiteLen - 1, "%s:%u",
+      file != nullptr ? file + 1 : site->file, site->line);
+}
+
+void SemaphoreSet::note_acquired(sem_nameid_t sem_numid, int32_t permits,
+  int64_t wait_begin_ns, uint8_t outcome, CallSiteStats *caller) {
+    int64_t now_ns  = monotonic_ns();
+    SemStats &stats = this->ctrl->sems()[sem_numid].stats;
+    stats.acquisitions.fetch_add(1, std::memory_order_relaxed);
+    stats.wait_ns.record(now_ns - wait_begin_ns);
+    HeldBy &held       = this->held_by[sem_numid];
+    held.since_ns      = now_ns;
+    held.site          = caller;
+    HolderSlot *holder = this->note_holder(sem_numid, permits, this->self_pid);
+    if (holder != nullptr) {
+        holder->site.store(this->site_of(caller), std::memory_order_relaxed);
+        holder->since_ns.store(now_ns, std::memory_order_relaxed);
+    }
+    this->trace(TRACE_ACQUIRE, sem_numid, permits, outcome);
+}
+
+int32_t SemaphoreSet::site_of(const CallSiteStats *caller) {
+    int32_t &site = this->site_ids[call_site_index(caller)];
+    if (site == -1) {
+        site = this->intern_site(caller);
+    }
+    return site;
+}
+
+/// @note: a process that died while writing an entry leaves it at 1,
+/// such an entry is skipped and the site may end up in two entries
+int32_t SemaphoreSet::intern_site(const CallSiteStats *caller) {
+    char text[kHolderSiteLen] = {};
+    format_site(text, caller);
+    for (int32_t i = 0; i < kMaxSiteNames; ++i) {
+        SiteName &entry = this->ctrl->site_names[i];
+        uint32_t state  = entry.state.load(std::memory_order_acquire);
+        if (state == 0 && entry.state.compare_exchange_strong(state, 1)) {
+            std::copy(text, text + kHolderSiteLen - 1, entry.text);
+            entry.state.store(2, std::memory_order_release);
+            return i + 1;
+        }
+        if (state == 2 && std::strcmp(entry.text, text) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+void SemaphoreSet::note_parked(sem_nameid_t sem_numid, CallSiteStats *caller) {
+    this->ctrl->sems()[sem_numid].stats.parks.fetch_add(
+      1, std::memory_order_relaxed);
+    caller->parks.fetch_add(1, std::memory_order_relaxed);
+    this->trace(TRACE_PARK, sem_numid, 0);
+}
+
+/// @note: a process holding several permits of one semaphore charges
+/// every release from its latest acquisition. Call it before the holder
+/// slot is updated
+void SemaphoreSet::note_released(sem_nameid_t sem_numid, int32_t permits) {
+    HeldBy &held = this->held_by[sem_numid];
+    if (held.site == nullptr) {
+        return; // not taken by a Swait of this process
+    }
+
+    int64_t held_ns = monotonic_ns() - held.since_ns;
+    held.site->record_hold(held_ns);
+    this->ctrl->sems()[sem_numid].stats.hold_ns.record(held_ns);
+    if (this->config.long_hold_ns > 0 && held_ns > this->config.long_hold_ns) {
+        char site[kHolderSiteLen] = {};
+        format_site(site, held.site);
+        this->warn_long_hold(sem_numid, this->self_pid, site, held_ns);
+    }
+
+    HolderSlot *holder = this->find_holder(sem_numid, this->self_pid);
+    if (holder == nullptr || holder->count.load() <= permits) {
+        held.since_ns = 0;
+        held.site     = nullptr;
+    }
+}
+
+void SemaphoreSet::check_long_holds() {
+    int64_t now_ns = monotonic_ns();
+    for (int32_t i = 0; i < this->num_sems; ++i) {
+        for (auto &holder : this->ctrl->sems()[i].holders) {
+            pid_t pid        = holder.pid.load();
+            int64_t since_ns = holder.since_ns.load(std::memory_order_relaxed);
+            /// @note: a slot just claimed is not stamped yet
+            if (pid != 0 && since_ns != 0 &&
+                now_ns - since_ns > this->config.long_hold_ns)
+            {
+                this->warn_long_hold(i, pid,
+                  this->ctrl->site_name(holder.site.load()),
+                  now_ns - since_ns);
+            }
+        }
+    }
+}
+
+void SemaphoreSet::warn_long_hold(
+  sem_nameid_t sem_numid, pid_t pid, const char *site, int64_t held_ns) {
+    int64_t now_ns = monotonic_ns();
+    int64_t last   = this->ctrl->last_long_hold_warn_ns.load();
+    if (now_ns - last < this->config.long_hold_warn_interval_ns ||
+        !this->ctrl->last_long_hold_warn_ns.compare_exchange_strong(
+          last, now_ns))
+    {
+        return;
+    }
+    spdlog::warn("Process {} has held sem {} for {}ms, taken at {}", pid,
+      this->ids.id_of(sem_numid), held_ns / 1000000, site);
+}
+
+/// @note: counted before the claim and uncounted after the release, a
+/// process dying in between leaves num_waiters too high, never too low
+int32_t SemaphoreSet::enter_waiters(sem_nameid_t blocked_on) {
+    this->ctrl->num_waiters.fetch_add(1);
+    for (int32_t i = 0; i < kMaxWaiters; ++i) {
+        WaiterSlot &waiter = this->ctrl->waiters[i];
+        pid_t expected     = 0;
+        if (waiter.pid.compare_exchange_strong(expected, this->self_pid)) {
+            waiter.granted    = 0;
+            waiter.blocked_on = blocked_on;
+            waiter.aborted.store(0);
+            waiter.ticket  = this->ctrl->next_ticket.fetch_add(1);
+            waiter.num_ops = 0;
+            return i;
+        }
+    }
+    this->ctrl->num_waiters.fetch_sub(1);
+    return -1;
+}
+
+void SemaphoreSet::leave_waiters(WaiterSlot &waiter) {
+    waiter.pid.store(0);
+    this->ctrl->num_waiters.fetch_sub(1);
+}
+
+/// @note: a waiter that dies before it picks up hand-off permits keeps
+/// them reserved, and a wake-up it never consumed would be taken by the
+/// next process parking on its slot. Both are undone here, the slot is
+/// only taken again under the lock in hand-off mode. Outside it a stale
+/// token is left alone, it only wakes the next process on the slot once
+int32_t SemaphoreSet::reap_dead_waiters(pid_t dead) {
+    int32_t reaped = 0;
+    for (auto &waiter : this->ctrl->waiters) {
+        pid_t pid = waiter.pid.load();
+        if (pid == 0 ||
+            (pid != dead && !(kill(pid, 0) == -1 && errno == ESRCH)) ||
+            !waiter.pid.compare_exchange_strong(pid, 0))
+        {
+            continue;
+        }
+
+        this->ctrl->num_waiters.fetch_sub(1);
+        int32_t slot = &waiter - this->ctrl->waiters;
+        spdlog::warn("Reap waiter slot {} of dead process {}", slot, pid);
+        if (this->config.handoff) {
+            for (int32_t i = 0; i < waiter.num_ops && waiter.granted; ++i) {
+                if (waiter.ops[i].sem_op < 0) {
+                    this->ctrl->sems()[waiter.ops[i].sem_numid].reserved +=
+                      waiter.ops[i].sem_op;
+                }
+            }
+            semun arg;
+            arg.val = 0;
+            if (semctl(this->park_semid, slot, SETVAL, arg) == -1) {
+                check_semctl_error();
+            }
+        }
+        ++reaped;
+    }
+
+    if (reaped > 0 && this->config.handoff) {
+        this->grant_waiters();
+    }
+    return reaped;
+}
+
+void SemaphoreSet::return_permits(sem_nameid_t sem_numid, int16_t permits) {
+    permits -= claim_debt(this->ctrl->sems()[sem_numid].debt, permits);
+    this->adjust(sem_numid, permits);
+}
+
+void SemaphoreSet::return_lease(LeaseSlot &lease) {
+    for (int32_t i = 0; i < lease.num_ops; ++i) {
+        if (lease.ops[i].sem_op < 0) {
+            this->note_holder(
+              lease.ops[i].sem_numid, lease.ops[i].sem_op, lease.owner);
+            this->return_permits(lease.ops[i].sem_numid, -lease.ops[i].sem_op);
+        }
+    }
+    lease.state.store(
+      lease_word(lease_generation(lease.state.load()), LEASE_FREE));
+    this->ctrl->live_leases.fetch_sub(1);
+}
+
+/// @note: cheap when no lease is alive, the table is only walked otherwise
+void SemaphoreSet::reclaim_expired_leases() {
+    if (this->ctrl->live_leases.load() == 0) {
+        return;
+    }
+
+    int64_t now_ns = monotonic_ns();
+    for (auto &lease : this->ctrl->leases) {
+        uint64_t word = lease.state.load();
+        if (lease_state(word) != LEASE_ACTIVE ||
+            (lease.expires_ns.load() > now_ns &&
+              !(kill(lease.owner, 0) == -1 && errno == ESRCH)))
+        {
+            continue;
+        }
+
+        if (lease.state.compare_exchange_strong(
+              word, lease_word(lease_generation(word), LEASE_BUSY)))
+        {
+            spdlog::warn("Reclaim lease {} of process {}, expired {}ns ago",
+              &lease - this->ctrl->leases, lease.owner,
+              now_ns - lease.expires_ns.load());
+            for (int32_t i = 0; i < lease.num_ops; ++i) {
+                this->trace(TRACE_RECLAIM, lease.ops[i].sem_numid,
+                  -lease.ops[i].sem_op);
+            }
+            this->return_lease(lease);
+        }
+    }
+}
+
+bool SemaphoreSet::park(int32_t on_semid, sembuf op) {
+    while (true) {
+        int64_t first_expiry_ns = INT64_MAX;
+        if (this->config.deadlock_check_ns > 0) {
+            first_expiry_ns = monotonic_ns() + this->config.deadlock_check_ns;
+        }
+        if (this->config.long_hold_ns > 0) {
+            first_expiry_ns = std::min(
+              first_expiry_ns, monotonic_ns() + this->config.long_hold_ns);
+        }
+        if (this->ctrl->live_leases.load() > 0) {
+            for (auto &lease : this->ctrl->leases) {
+                if (lease_state(lease.state.load()) == LEASE_ACTIVE) {
+                    first_expiry_ns =
+                      std::min(first_expiry_ns, lease.expires_ns.load());
+                }
+            }
+        }
+
+        int32_t ret;
+        if (first_expiry_ns == INT64_MAX) {
+            ret = semop(on_semid, &op, 1);
+        }
+        else {
+            int64_t wait_ns =
+              std::max< int64_t >(first_expiry_ns - monotonic_ns(), 1000000);
+            timespec timeout = {wait_ns / 1000000000LL, wait_ns % 1000000000LL};
+            ret = semtimedop(on_semid, &op, 1, &timeout);
+        }
+
+        if (ret == 0) {
+            return true;
+        }
+        if (errno == EAGAIN) {
+            return false;
+        }
+        if (errno != EINTR) {
+            spdlog::error("Error parking happen in {}", __LINE__);
+            exit(1);
+        }
+    }
+}
+
+void SemaphoreSet::on_park_timeout(sem_nameid_t blocked_on) {
+    this->ctrl->sems()[blocked_on].stats.timeouts.fetch_add(
+      1, std::memory_order_relaxed);
+    this->reclaim_expired_leases();
+    if (this->config.deadlock_check_ns > 0) {
+        this->detect_deadlocks(this->config.break_deadlocks);
+    }
+    if (this->config.long_hold_ns > 0) {
+        this->check_long_holds();
+    }
+}
+
+lease_id_t SemaphoreSet::SwaitLease(
+  const sem_nameid_min_val_vec_t &sem_op_min_val_vector, int64_t ttl_ns,
+  CallSite site) {
+    if (sem_op_min_val_vector.size() > (size_t)kMaxWaitOps) {
+        spdlog::error("Swait with more than {} semaphores can not be leased",
+          kMaxWaitOps);
+        exit(1);
+    }
+    if (this->config.threads) {
+        spdlog::error("The threads backend has no leases");
+        exit(1);
+    }
+
+    LeaseSlot *lease    = nullptr;
+    uint32_t generation = 0;
+    for (auto &slot : this->ctrl->leases) {
+        uint64_t word = slot.state.load();
+        generation    = (lease_generation(word) + 1) & kLeaseGenMask;
+        if (lease_state(word) == LEASE_FREE &&
+            slot.state.compare_exchange_strong(
+              word, lease_word(generation, LEASE_CLAIMED)))
+        {
+            lease = &slot;
+            break;
+        }
+    }
+    if (lease == nullptr) {
+        spdlog::error("All {} leases are taken", kMaxLeases);
+        exit(1);
+    }
+
+    sem_nameid_min_val_vec_t scratch;
+    const sem_nameid_min_val_vec_t &request =
+      this->resolve(sem_op_min_val_vector, scratch);
+    lease->owner   = this->self_pid;
+    lease->ttl_ns  = ttl_ns;
+    lease->num_ops = 0;
+    for (auto &sem_op_with_min_val : request) {
+        lease->ops[lease->num_ops++] = {sem_op_with_min_val.first,
+          (int16_t)sem_op_with_min_val.second.sem_op,
+          sem_op_with_min_val.second.min_val};
+    }
+
+    if (!this->wait(request, site)) {
+        lease->state.store(lease_word(generation, LEASE_FREE));
+        return -1;
+    }
+
+    /// @note: hand the undo value of what we took back to the kernel,
+    /// from now on the lease is what gives the permits back
+    for (int32_t i = 0; i < lease->num_ops; ++i) {
+        if (lease->ops[i].sem_op >= 0) {
+            continue;
+        }
+        sembuf bufs[2] = {
+          {lease->ops[i].sem_numid, (short)-lease->ops[i].sem_op, SEM_UNDO},
+          {lease->ops[i].sem_numid, lease->ops[i].sem_op,         0       },
+        };
+        if (this->shard_semop(this->semids, bufs, 2) == -1) {
+            spdlog::error("Error leasing semaphore happen in {}", __LINE__);
+            exit(1);
+        }
+    }
+
+    lease->expires_ns.store(monotonic_ns() + ttl_ns);
+    this->ctrl->live_leases.fetch_add(1);
+    lease->state.store(lease_word(generation, LEASE_ACTIVE));
+    return (lease_id_t)(generation << kLeaseIndexBits |
+                        (uint32_t)(lease - this->ctrl->leases));
+}
+
+LeaseSlot *SemaphoreSet::take_lease(lease_id_t lease_id) {
+    int32_t index = lease_id & ((1 << kLeaseIndexBits) - 1);
+    if (lease_id < 0 || index >= kMaxLeases) {
+        return nullptr;
+    }
+    LeaseSlot &lease    = this->ctrl->leases[index];
+    uint32_t generation = (uint32_t)lease_id >> kLeaseIndexBits;
+    uint64_t expected   = lease_word(generation, LEASE_ACTIVE);
+    if (lease.owner != this->self_pid ||
+        !lease.state.compare_exchange_strong(
+          expected, lease_word(generation, LEASE_BUSY)))
+    {
+        return nullptr;
+    }
+    return &lease;
+}
+
+bool SemaphoreSet::renewLease(lease_id_t lease_id) {
+    LeaseSlot *lease = this->take_lease(lease_id);
+    if (lease == nullptr) {
+        return false;
+    }
+    lease->expires_ns.store(monotonic_ns() + lease->ttl_ns);
+    lease->state.store(lease_word(
+      (uint32_t)lease_id >> kLeaseIndexBits, LEASE_ACTIVE));
+    return true;
+}
+
+bool SemaphoreSet::SsignalLease(lease_id_t lease_id) {
+    LeaseSlot *lease = this->take_lease(lease_id);
+    if (lease == nullptr) {
+        spdlog::warn("Lease {} was reclaimed before its Ssignal", lease_id);
+        return false;
+    }
+    for (int32_t i = 0; i < lease->num_ops; ++i) {
+        if (lease->ops[i].sem_op < 0) {
+            this->note_released(
+              lease->ops[i].sem_numid, -lease->ops[i].sem_op);
+        }
+    }
+    this->return_lease(*lease);
+    return true;
+}
+
+void SemaphoreSet::resize(sem_nameid_t sem_id, int32_t new_capacity) {
+    if (new_capacity < 0 || new_capacity > kMaxSemValue) {
+        spdlog::error("Can not resize sem {} to {}, the range is 0 to {}",
+          sem_id, new_capacity, kMaxSemValue);
+        exit(1);
+    }
+    sem_nameid_t sem_numid = this->resolve(sem_id);
+    SemSlot &slot          = this->ctrl->sems()[sem_numid];
+    int32_t delta = new_capacity - slot.capacity.exchange(new_capacity);
+    this->trace(TRACE_RESIZE, sem_numid, new_capacity);
+
+    if (delta > 0) {
+        delta -= claim_debt(slot.debt, delta);
+        this->adjust(sem_numid, (int16_t)delta);
+    }
+    else if (delta < 0) {
+        int32_t applied = this->adjust(sem_numid, (int16_t)delta);
+        slot.debt.fetch_add(applied - delta);
+    }
+    spdlog::debug("Resize sem {} to {}, {} permits still to swallow", sem_id,
+      new_capacity, slot.debt.load());
+}
+
+int32_t SemaphoreSet::getCapacity(sem_nameid_t sem_numid) const {
+    return this->ctrl->sems()[this->resolve(sem_numid)].capacity.load();
+}
+
+void SemaphoreSet::setName(sem_nameid_t sem_numid, const std::string &name) {
+    SemSlot &slot = this->ctrl->sems()[this->resolve(sem_numid)];
+    if (name.empty() || name.size() >= (size_t)kSemNameLen) {
+        spdlog::error("Semaphore name \"{}\" must have 1 to {} characters",
+          name, kSemNameLen - 1);
+        exit(1);
+    }
+    if (slot.label[0] != '\0' || this->lookupName(name) != -1) {
+        spdlog::error("Can not name sem {} \"{}\", it or the name is taken",
+          sem_numid, name);
+        exit(1);
+    }
+
+    /// @note: the label is written before the entry is published, a
+    /// reader that finds the entry finds the whole name
+    std::copy(name.begin(), name.end(), slot.label);
+    uint32_t mask = ControlBlock::name_slots_for(num_sems) - 1;
+    int32_t entry = (&slot - this->ctrl->sems()) + 1;
+    for (uint32_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+        int32_t expected = 0;
+        if (this->ctrl->names()[i].compare_exchange_strong(expected, entry)) {
+            return;
+        }
+    }
+}
+
+int32_t SemaphoreSet::lookupName(const std::string &name) const {
+    uint32_t mask = ControlBlock::name_slots_for(num_sems) - 1;
+    for (uint32_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+        int32_t entry = this->ctrl->names()[i].load();
+        if (entry == 0) {
+            return -1;
+        }
+        const SemSlot &slot = this->ctrl->sems()[entry - 1];
+        if (name == slot.label) {
+            return slot.name;
+        }
+    }
+}
+
+const char *SemaphoreSet::getName(sem_nameid_t sem_numid) const {
+    return this->ctrl->sems()[this->resolve(sem_numid)].label;
+}
+
+bool SemaphoreSet::dump_trace(const char *path) {
+    if (this->trace_ring == nullptr) {
+        spdlog::error("Tracing is off, set trace_capacity to turn it on");
+        return false;
+    }
+    return write_trace_file(*this->trace_ring, path);
+}
+
+bool SemaphoreSet::dump_chrome_trace(const char *path) {
+    if (this->trace_ring == nullptr) {
+        spdlog::error("Tracing is off, set trace_capacity to turn it on");
+        return false;
+    }
+    std::ofstream os(path);
+    if (!os) {
+        spdlog::error("Error opening {}", path);
+        return false;
+    }
+    export_chrome_trace(this->trace_ring->snapshot(), os);
+    return true;
+}
+
+int32_t SemaphoreSet::getSemid() const { return this->semids[0]; }
+
+int64_t SemaphoreSet::getConstructNs() const { return this->construct_ns; }
+
+const ControlBlock *SemaphoreSet::getControlBlock() const {
+    return this->ctrl;
+}
+
+int32_t SemaphoreSet::getVal(sem_nameid_t sem_numid) const {
+    return this->value_of(this->resolve(sem_numid));
+}
+
+int32_t SemaphoreSet::value_of(sem_nameid_t sem_numid) const {
+    if (this->config.threads) {
+        return this->ctrl->sems()[sem_numid].value.load();
+    }
+    return semctl(this->semid_of(sem_numid), this->index_of(sem_numid), GETVAL);
+}
+
+SemaphoreSet::~SemaphoreSet() {
+    this->untrack_handle();
+    if (!this->owns_mappings) {
+        return;
+    }
+
+    /// @note: the creator removes the kernel sets, the park set and the
+    /// key's segment, attached handles and forked children only unmap.
+    /// Until the set is ready the park set is only known to this handle
+    if (this->owns_sets) {
+        for (int32_t semid : this->semids) {
+            if (semid != -1) {
+                semctl(semid, 0, IPC_RMID);
+            }
+        }
+        int32_t park_semid = this->park_semid;
+        if (this->ctrl != nullptr && this->ctrl->ready.load() != 0) {
+            park_semid = this->ctrl->park_semid.load();
+        }
+        if (park_semid != -1) {
+            semctl(park_semid, 0, IPC_RMID);
+        }
+        if (this->ctrl_shmid != -1) {
+            shmctl(this->ctrl_shmid, IPC_RMID, nullptr);
+        }
+    }
+
+    if (this->ctrl != nullptr && this->ctrl_shmid != -1) {
+        shmdt(this->ctrl);
+    }
+    else if (this->ctrl != nullptr) {
+        munmap(this->ctrl, ControlBlock::size_for(num_sems));
+    }
+    this->ctrl = nullptr;
+    if (this->trace_ring != nullptr) {
+        munmap(
+          this->trace_ring, TraceRing::size_for(this->trace_ring->capacity));
+        this->trace_ring = nullptr;
+    }
 }
 
 } // namespace lap
@@ -0,0 +1,192 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "semaphore_set.h"
+
+namespace lap {
+
+namespace {
+
+/// @note: sleep while `epoch` is still `seen`, std::atomic::wait where
+/// the library has it, the futex it is built on otherwise
+void wait_epoch(std::atomic< uint32_t > &epoch, uint32_t seen) {
+#if defined(__cpp_lib_atomic_wait)
+    epoch.wait(seen);
+#else
+    syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+#endif
+}
+
+void wake_epoch(std::atomic< uint32_t > &epoch) {
+#if defined(__cpp_lib_atomic_wait)
+    epoch.notify_all();
+#else
+    syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr,
+      0);
+#endif
+}
+
+/// @note: take `-sem_op` permits while at least `needed` are there, a
+/// CAS so that no other taker can slip in between check and take
+bool take_value(std::atomic< int32_t > &value, int32_t needed,
+  int32_t sem_op) {
+    int32_t seen = value.load();
+    while (seen >= needed) {
+        if (value.compare_exchange_weak(seen, seen + sem_op)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+/// @note: the entries that take are applied in order and given back on
+/// the first that is short, gains only go in once every take went
+/// through, so a rollback never takes away what another thread may have
+/// used. What a rollback gives back wakes the sleepers of it, they may
+/// have seen it short meanwhile. Returns the semaphore that is short, -1
+/// when all were applied
+int32_t SemaphoreSet::thread_try(const sem_nameid_min_val_vec_t &request) {
+    SemSlot *sems   = this->ctrl->sems();
+    size_t applied  = 0;
+    int32_t blocker = -1;
+    for (auto &[sem_numid, to_reduce] : request) {
+        int32_t needed = needed_value(to_reduce.min_val, to_reduce.sem_op);
+        if (to_reduce.sem_op > 0 ? sems[sem_numid].value.load() < needed
+                                 : !take_value(sems[sem_numid].value,
+                                     needed, to_reduce.sem_op))
+        {
+            blocker = sem_numid;
+            break;
+        }
+        ++applied;
+    }
+    for (size_t i = 0; i < request.size(); ++i) {
+        auto &[sem_numid, to_reduce] = request[i];
+        if (blocker == -1 && to_reduce.sem_op > 0) {
+            sems[sem_numid].value.fetch_add(to_reduce.sem_op);
+        }
+        else if (blocker != -1 && i < applied && to_reduce.sem_op < 0) {
+            sems[sem_numid].value.fetch_sub(to_reduce.sem_op);
+            this->wake_threads(sem_numid);
+        }
+    }
+    return blocker;
+}
+
+/// @note: a request on one semaphore is a single CAS. Requests on more
+/// take thread_lock, so two of them never hold part of each other's
+/// permits and keep retrying. Releases take nothing
+///
+/// @note: a thread counts itself as a sleeper of the semaphore that is
+/// short and checks once more before it sleeps on the epoch of that
+/// semaphore. A release of it that comes after the check sees the
+/// sleeper and bumps the epoch read before the check, so the sleep
+/// returns at once
+///
+/// @note: the clock is only read once a request is short, one that gets
+/// through at once is counted as a wait of 0
+bool SemaphoreSet::thread_wait(
+  const sem_nameid_min_val_vec_t &sem_op_min_val_vector,
+  CallSiteStats *caller) {
+    SemSlot *sems         = this->ctrl->sems();
+    int32_t sleeping_on   = -1;
+    int64_t wait_begin_ns = 0;
+    while (true) {
+        uint32_t epoch =
+          sleeping_on == -1 ? 0 : sems[sleeping_on].epoch.load();
+        int32_t blocker;
+        if (sem_op_min_val_vector.size() == 1) {
+            blocker = this->thread_try(sem_op_min_val_vector);
+        }
+        else {
+            std::lock_guard< std::mutex > lock(*this->thread_lock);
+            blocker = this->thread_try(sem_op_min_val_vector);
+        }
+        if (blocker == -1) {
+            break;
+        }
+        if (blocker != sleeping_on) {
+            if (sleeping_on != -1) {
+                sems[sleeping_on].sleepers.fetch_sub(1);
+            }
+            else {
+                wait_begin_ns = monotonic_ns();
+            }
+            sleeping_on = blocker;
+            sems[blocker].sleepers.fetch_add(1);
+            continue;
+        }
+        this->note_parked(blocker, caller);
+        wait_epoch(sems[blocker].epoch, epoch);
+    }
+    bool sleeper    = sleeping_on != -1;
+    int64_t wait_ns = 0;
+    if (sleeper) {
+        sems[sleeping_on].sleepers.fetch_sub(1);
+        wait_ns = monotonic_ns() - wait_begin_ns;
+    }
+
+    for (auto &[sem_numid, to_reduce] : sem_op_min_val_vector) {
+        if (to_reduce.sem_op < 0) {
+            SemStats &stats = sems[sem_numid].stats;
+            stats.acquisitions.fetch_add(1, std::memory_order_relaxed);
+            stats.wait_ns.record(wait_ns);
+            this->trace(TRACE_ACQUIRE, sem_numid, -to_reduce.sem_op,
+              sleeper ? TRACE_WOKEN : TRACE_FAST);
+        }
+        else if (to_reduce.sem_op > 0) {
+            this->wake_threads(sem_numid);
+        }
+    }
+    caller->record_wait(wait_ns);
+    return true;
+}
+
+/// @note: a negative sem_op takes permits, like a Swait of them
+void SemaphoreSet::thread_signal(sem_nameid_t sem_numid, int16_t sem_op) {
+    if (sem_op < 0) {
+        this->thread_wait({{sem_numid, {0, sem_op}}}, call_site_stats({}));
+        return;
+    }
+    if (sem_op > 0) {
+        this->ctrl->sems()[sem_numid].value.fetch_add(sem_op);
+        this->wake_threads(sem_numid);
+    }
+}
+
+int32_t SemaphoreSet::thread_adjust(sem_nameid_t sem_numid, int16_t delta) {
+    std::atomic< int32_t > &value = this->ctrl->sems()[sem_numid].value;
+    if (delta > 0) {
+        value.fetch_add(delta);
+        this->wake_threads(sem_numid);
+        return delta;
+    }
+
+    /// @note: never block here, whatever is held stays with its holder
+    int32_t seen = value.load();
+    int32_t take = std::min< int32_t >(-delta, seen);
+    while (take > 0 && !value.compare_exchange_weak(seen, seen - take)) {
+        take = std::min< int32_t >(-delta, seen);
+    }
+    return take > 0 ? -take : 0;
+}
+
+/// @note: call it after the permits of `sem_numid` are back, nothing to
+/// do while no thread counts itself as its sleeper, see thread_wait
+void SemaphoreSet::wake_threads(sem_nameid_t sem_numid) {
+    SemSlot &slot = this->ctrl->sems()[sem_numid];
+    if (slot.sleepers.load() > 0) {
+        slot.epoch.fetch_add(1);
+        wake_epoch(slot.epoch);
+    }
+}
+
+} // namespace lap
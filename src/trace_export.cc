@@ -0,0 +1,150 @@
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "sem_trace.h"
+
+namespace lap {
+
+namespace {
+
+/// what one process is in the middle of, rebuilt while replaying records
+struct ProcessState {
+    int64_t wait_begin_ns = -1;
+    int64_t park_begin_ns = -1;
+    uint16_t wait_sem     = 0;
+    /// sem -> acquisition stamps not matched by a Ssignal yet
+    std::map< uint16_t, std::deque< int64_t > > holds;
+};
+
+class ChromeWriter {
+  private:
+    std::ostream &os;
+    int64_t origin_ns;
+    bool first = true;
+    uint64_t next_hold_id = 0;
+
+    void begin_event() {
+        os << (first ? "\n" : ",\n");
+        first = false;
+    }
+
+    double us(int64_t ts_ns) const { return (ts_ns - origin_ns) / 1000.0; }
+
+  public:
+    ChromeWriter(std::ostream &os, int64_t origin_ns)
+        : os(os), origin_ns(origin_ns) {
+        os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    }
+
+    void process_name(int32_t pid) {
+        begin_event();
+        os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+           << ",\"args\":{\"name\":\"Process " << pid << "\"}}";
+    }
+
+    void slice(const char *name, uint16_t sem, int32_t pid, int64_t from_ns,
+      int64_t to_ns) {
+        begin_event();
+        os << "{\"name\":\"" << name << " sem " << sem
+           << "\",\"cat\":\"wait\",\"ph\":\"X\",\"pid\":" << pid
+           << ",\"tid\":" << pid << ",\"ts\":" << us(from_ns)
+           << ",\"dur\":" << us(to_ns) - us(from_ns) << "}";
+    }
+
+    void hold(uint16_t sem, int32_t pid, int64_t from_ns, int64_t to_ns) {
+        uint64_t id                          = next_hold_id++;
+        const std::pair< char, int64_t > ends[] = {
+          {'b', from_ns},
+          {'e', to_ns  }
+        };
+        for (const auto &[ph, ts_ns] : ends) {
+            begin_event();
+            os << "{\"name\":\"hold sem " << sem
+               << "\",\"cat\":\"hold\",\"ph\":\"" << ph << "\",\"id\":" << id
+               << ",\"pid\":" << pid << ",\"tid\":" << pid
+               << ",\"ts\":" << us(ts_ns) << "}";
+        }
+    }
+
+    void instant(const char *name, uint16_t sem, int32_t pid, int64_t ts_ns,
+      int32_t value) {
+        begin_event();
+        os << "{\"name\":\"" << name << " sem " << sem
+           << "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":" << pid
+           << ",\"tid\":" << pid << ",\"ts\":" << us(ts_ns)
+           << ",\"args\":{\"value\":" << value << "}}";
+    }
+
+    ~ChromeWriter() { os << "\n]}\n"; }
+};
+
+} // namespace
+
+void export_chrome_trace(
+  const std::vector< TraceRecord > &records, std::ostream &os) {
+    ChromeWriter writer(os, records.empty() ? 0 : records.front().ts_ns);
+    std::map< int32_t, ProcessState > processes;
+
+    for (const auto &rd : records) {
+        auto [it, is_new]    = processes.try_emplace(rd.pid);
+        ProcessState &state = it->second;
+        if (is_new) {
+            writer.process_name(rd.pid);
+        }
+
+        switch (rd.op) {
+            case TRACE_WAIT_BEGIN:
+                state.wait_begin_ns = rd.ts_ns;
+                state.park_begin_ns = -1;
+                state.wait_sem      = rd.sem_numid;
+                break;
+            case TRACE_PARK:
+                /// @note: a process re-parks after losing a race, the
+                /// blocked slice spans all of it
+                if (state.park_begin_ns == -1) {
+                    state.park_begin_ns = rd.ts_ns;
+                }
+                state.wait_sem = rd.sem_numid;
+                break;
+            case TRACE_ACQUIRE:
+            case TRACE_ABORT:
+                if (state.park_begin_ns != -1) {
+                    writer.slice("blocked on", state.wait_sem, rd.pid,
+                      state.park_begin_ns, rd.ts_ns);
+                }
+                if (state.wait_begin_ns != -1) {
+                    writer.slice(
+                      rd.op == TRACE_ABORT ? "aborted Swait" : "Swait",
+                      state.wait_sem, rd.pid, state.wait_begin_ns, rd.ts_ns);
+                }
+                state.wait_begin_ns = -1;
+                state.park_begin_ns = -1;
+                if (rd.op == TRACE_ACQUIRE) {
+                    state.holds[rd.sem_numid].push_back(rd.ts_ns);
+                }
+                break;
+            case TRACE_SIGNAL: {
+                auto &pending = state.holds[rd.sem_numid];
+                if (pending.empty()) {
+                    /// @note: released what another process acquired
+                    writer.instant("Ssignal", rd.sem_numid, rd.pid, rd.ts_ns,
+                      rd.value);
+                    break;
+                }
+                writer.hold(rd.sem_numid, rd.pid, pending.front(), rd.ts_ns);
+                pending.pop_front();
+                break;
+            }
+            default:
+                writer.instant(trace_op_name(rd.op), rd.sem_numid, rd.pid,
+                  rd.ts_ns, rd.value);
+                break;
+        }
+    }
+}
+
+} // namespace lap
@@ -0,0 +1,344 @@
+#include "worker_pool.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/sem.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <utility>
+
+namespace lap {
+
+namespace {
+
+constexpr unsigned short FREE    = 0; // cells a job can be put into
+constexpr unsigned short QUEUED  = 1; // jobs no worker has taken yet
+constexpr unsigned short DRAINED = 2; // the last job submitted is done
+
+constexpr int32_t kStopJob      = -1;
+constexpr int32_t kMaxCapacity  = 32767; // SEMVMX
+constexpr int32_t kMaxWorkers   = 32767; // fits the taker bits of a seq
+constexpr int64_t kCheckNs      = 10000000; // drain and full queue
+constexpr int32_t kSpinsPerReap = 1024;
+
+using semun = union {
+    int val;               /* Value for SETVAL */
+    unsigned short *array; /* Array for SETALL */
+};
+
+/// @note: without SEM_UNDO, a queued job stays queued when the process
+/// that queued it exits. -1 once the pool is gone
+int32_t pool_semop(int32_t semid, sembuf *ops, int32_t num_ops,
+  const timespec *timeout = nullptr) {
+    int32_t ret;
+    while ((ret = semtimedop(semid, ops, num_ops, timeout)) == -1 &&
+           errno == EINTR)
+    {
+    }
+    return ret;
+}
+
+int32_t pool_semop(int32_t semid, unsigned short sem_num, int16_t sem_op,
+  const timespec *timeout = nullptr) {
+    sembuf op = {sem_num, sem_op, 0};
+    return pool_semop(semid, &op, 1, timeout);
+}
+
+} // namespace
+
+WorkerPool::WorkerPool(SemaphoreSet &sem_set, int32_t num_workers,
+  handler_t handler, int32_t queue_capacity)
+    : sem_set(sem_set), handler(std::move(handler)), owner(getpid()) {
+    if (num_workers < 1 || num_workers > kMaxWorkers || queue_capacity < 1 ||
+        queue_capacity > kMaxCapacity)
+    {
+        spdlog::error("A pool needs 1 to {} workers and a queue of 1 to {} "
+                      "jobs",
+          kMaxWorkers, kMaxCapacity);
+        exit(1);
+    }
+
+    void *addr = mmap(nullptr, PoolQueue::size_for(queue_capacity, num_workers),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        spdlog::error("Error mapping job queue in {}", __LINE__);
+        exit(1);
+    }
+    this->queue              = (PoolQueue *)addr;
+    this->queue->capacity    = queue_capacity;
+    this->queue->num_workers = num_workers;
+    for (int32_t i = 0; i < queue_capacity; ++i) {
+        this->queue->cells()[i].seq.store(i);
+    }
+
+    this->semid = semget(IPC_PRIVATE, 3, IPC_CREAT | 0600);
+    unsigned short values[3] = {(unsigned short)queue_capacity, 0, 0};
+    semun arg;
+    arg.array = values;
+    if (this->semid == -1 || semctl(this->semid, 0, SETALL, arg) == -1) {
+        spdlog::error("Error creating pool semaphores in {} error {}",
+          __LINE__, std::strerror(errno));
+        exit(1);
+    }
+
+    for (int32_t i = 0; i < num_workers; ++i) {
+        pid_t pid = this->spawn(i);
+        if (pid == -1) {
+            spdlog::error("Error forking worker in {}", __LINE__);
+            this->stop();
+            exit(1);
+        }
+        this->workers.push_back(pid);
+    }
+}
+
+pid_t WorkerPool::spawn(int32_t index) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        this->work(index);
+    }
+    return pid;
+}
+
+/// @note: the queued job is taken with SEM_UNDO, a worker that dies
+/// before it marked a cell as its own gives it back to the others. The
+/// undo is cancelled in the same semop that frees the cell
+void WorkerPool::work(int32_t index) {
+    /// @note: a worker whose pool is gone would wait for jobs forever
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != this->owner) {
+        _exit(EXIT_FAILURE);
+    }
+
+    SemaphoreSet mine            = this->sem_set.clone_for_child();
+    int32_t capacity             = this->queue->capacity;
+    std::atomic< int32_t > &busy = this->queue->busy()[index];
+    sembuf take                  = {QUEUED, -1, SEM_UNDO};
+    sembuf settle[3]             = {
+      {QUEUED, 1,  SEM_UNDO},
+      {QUEUED, -1, 0       },
+      {FREE,   1,  0       }
+    };
+    while (pool_semop(this->semid, &take, 1) != -1) {
+        uint64_t pos          = 0;
+        PoolQueue::Cell *cell = nullptr;
+        while (cell == nullptr) {
+            pos                 = this->queue->head.load();
+            PoolQueue::Cell &at = this->queue->cells()[pos % capacity];
+            uint64_t seq        = at.seq.load(std::memory_order_acquire);
+            if (seq == pos + 1) {
+                if (at.seq.compare_exchange_strong(
+                      seq, PoolQueue::taken_seq(index, pos)))
+                {
+                    uint64_t expected = pos;
+                    this->queue->head.compare_exchange_strong(
+                      expected, pos + 1);
+                    cell = &at;
+                }
+            }
+            else if ((seq & PoolQueue::kTaken) != 0 &&
+                     (seq & PoolQueue::kPosMask) == pos + 1)
+            {
+                /// @note: taken by a worker that has not moved head yet
+                this->queue->head.compare_exchange_strong(pos, pos + 1);
+            }
+            else if (pos == this->queue->tail.load()) {
+                break; // a token left over by a dead worker, no job
+            }
+            else {
+                sched_yield(); // the submitter is still copying it in
+            }
+        }
+        if (cell == nullptr) {
+            pool_semop(this->semid, settle, 2);
+            continue;
+        }
+
+        PoolJob job = cell->job;
+        busy.store(job.kind != kStopJob);
+        pool_semop(this->semid, settle, 3);
+        cell->seq.store(pos + capacity, std::memory_order_release);
+        if (job.kind == kStopJob) {
+            _exit(EXIT_SUCCESS);
+        }
+
+        /// @note: an exception must not unwind into the code the worker
+        /// was forked from
+        try {
+            this->handler(job, mine);
+        }
+        catch (const std::exception &e) {
+            spdlog::error("Job of kind {} failed in worker {}: {}", job.kind,
+              getpid(), e.what());
+            _exit(EXIT_FAILURE);
+        }
+        catch (...) {
+            spdlog::error("Job of kind {} failed in worker {}", job.kind,
+              getpid());
+            _exit(EXIT_FAILURE);
+        }
+        /// @note: dying in between counts the job twice, never not at all
+        uint64_t completed = this->queue->completed.fetch_add(1) + 1;
+        busy.store(0);
+        if (completed >= this->queue->submitted.load()) {
+            sembuf drained = {DRAINED, 1, IPC_NOWAIT};
+            semop(this->semid, &drained, 1);
+        }
+    }
+    _exit(EXIT_FAILURE);
+}
+
+/// @note: a worker that died between taking its cell and freeing it may
+/// have posted the free cell already, one free cell too many only makes
+/// a submitter wait for the seq
+int32_t WorkerPool::reap_workers() {
+    int32_t reaped = 0;
+    for (int32_t index = 0; index < (int32_t)this->workers.size(); ++index) {
+        int status;
+        if (this->workers[index] == -1 ||
+            waitpid(this->workers[index], &status, WNOHANG) !=
+              this->workers[index])
+        {
+            continue;
+        }
+
+        int32_t lost     = this->queue->busy()[index].exchange(0);
+        int32_t capacity = this->queue->capacity;
+        for (int32_t i = 0; i < capacity; ++i) {
+            PoolQueue::Cell &cell = this->queue->cells()[i];
+            uint64_t seq          = cell.seq.load();
+            if ((seq & PoolQueue::kTaken) == 0 ||
+                (int32_t)((seq & ~PoolQueue::kTaken) >>
+                          PoolQueue::kTakerBits) != index)
+            {
+                continue;
+            }
+            uint64_t pos      = (seq & PoolQueue::kPosMask) - 1;
+            uint64_t expected = pos;
+            lost = lost || cell.job.kind != kStopJob;
+            this->queue->head.compare_exchange_strong(expected, pos + 1);
+            pool_semop(this->semid, FREE, 1);
+            cell.seq.store(pos + capacity, std::memory_order_release);
+        }
+        if (lost) {
+            this->queue->completed.fetch_add(1);
+        }
+        spdlog::warn("Worker {} exited with status {:#x}{}",
+          this->workers[index], status, lost ? ", its job is lost" : "");
+
+        this->workers[index] = this->stopped ? -1 : this->spawn(index);
+        ++reaped;
+    }
+    return reaped;
+}
+
+bool WorkerPool::push(const PoolJob &job) {
+    /// @note: the creator looks at the workers every kCheckNs while the
+    /// queue is full, it may be full of jobs nobody is left to take
+    bool owned     = getpid() == this->owner;
+    timespec check = {0, kCheckNs};
+    while (pool_semop(this->semid, FREE, -1, owned ? &check : nullptr) ==
+           -1)
+    {
+        if (errno != EAGAIN) {
+            return false;
+        }
+        this->reap_workers();
+    }
+    int32_t capacity      = this->queue->capacity;
+    uint64_t pos          = this->queue->tail.fetch_add(1);
+    PoolQueue::Cell &cell = this->queue->cells()[pos % capacity];
+    /// @note: counted as free, the worker is still copying it out, or
+    /// died doing so and only the creator can free the cell
+    for (int32_t spins = 1;
+         cell.seq.load(std::memory_order_acquire) != pos; ++spins)
+    {
+        if (spins % kSpinsPerReap == 0 && owned) {
+            this->reap_workers();
+        }
+        sched_yield();
+    }
+    cell.job = job;
+    cell.seq.store(pos + 1, std::memory_order_release);
+    return pool_semop(this->semid, QUEUED, 1) != -1;
+}
+
+/// @note: counted once it is queued, a failed push must not leave drain()
+/// waiting for it
+bool WorkerPool::submit(const PoolJob &job) {
+    if (this->stopped || !this->push(job)) {
+        return false;
+    }
+    this->queue->submitted.fetch_add(1);
+    return true;
+}
+
+/// @note: a wake-up of an earlier drain may still be there, or come in
+/// between the check and the semop, so the wait is checked again every
+/// kCheckNs, and the workers with it
+void WorkerPool::drain() {
+    semun arg;
+    arg.val = 0;
+    if (semctl(this->semid, DRAINED, SETVAL, arg) == -1) {
+        if (errno == EINVAL || errno == EIDRM) {
+            return; // the pool is gone, like the wait below
+        }
+        spdlog::error("Error resetting drain semaphore in {} error {}",
+          __LINE__, std::strerror(errno));
+        exit(1);
+    }
+    timespec check = {0, kCheckNs};
+    while (this->queue->completed.load() < this->queue->submitted.load()) {
+        if (getpid() == this->owner) {
+            this->reap_workers();
+        }
+        if (pool_semop(this->semid, DRAINED, -1, &check) == -1 &&
+            errno != EAGAIN)
+        {
+            return;
+        }
+    }
+}
+
+void WorkerPool::stop() {
+    if (this->stopped || getpid() != this->owner) {
+        return;
+    }
+    this->reap_workers();
+    this->stopped = true;
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+        this->push({kStopJob, {}});
+    }
+    for (pid_t pid : this->workers) {
+        if (pid != -1) {
+            waitpid(pid, nullptr, 0);
+        }
+    }
+    semctl(this->semid, 0, IPC_RMID);
+}
+
+int32_t WorkerPool::size() const { return this->workers.size(); }
+
+uint64_t WorkerPool::getCompleted() const {
+    return this->queue->completed.load();
+}
+
+WorkerPool::~WorkerPool() {
+    /// @note: a forked child has a copy of the object but not the workers
+    if (getpid() == this->owner) {
+        this->stop();
+    }
+    munmap(this->queue,
+      PoolQueue::size_for(this->queue->capacity, this->queue->num_workers));
+}
+
+} // namespace lap
@@ -0,0 +1,285 @@
+#include <signal.h>
+#include <spdlog/cfg/env.h>
+#include <spdlog/spdlog.h>
+#include <sys/mman.h>
+#include <sys/sem.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fault_injection.h"
+#include "holder_reaper.h"
+#include "sem_clock.h"
+#include "sem_stats.h"
+#include "semaphore_set.h"
+
+namespace {
+
+constexpr lap::sem_nameid_t POOL = 0;
+constexpr int64_t kStallNs       = 1000000000; // no recovery for this long
+constexpr int64_t kDrainNs       = 2000000000; // workers get to finish
+
+/// shared by the harness and every worker
+struct Shared {
+    std::atomic< bool > stopping;
+
+    /// @note: when the last victim died, -1 while it is dying and 0 once
+    /// some process acquired after it. Only one death is in flight at a
+    /// time, so each recovery is measured on its own
+    std::atomic< int64_t > kill_ns;
+    std::atomic< int32_t > kill_point;
+
+    std::atomic< uint64_t > acquisitions;
+    std::atomic< uint64_t > kills[lap::kNumFaultPoints];
+    std::atomic< int64_t > max_recovery_ns[lap::kNumFaultPoints];
+    lap::LatencyHistogram recovery_ns[lap::kNumFaultPoints];
+};
+
+Shared *shared          = nullptr;
+double kill_probability = 0.01;
+std::minstd_rand rng;
+
+void maybe_die(lap::FaultPoint point, uint16_t sem_numid) {
+    if (shared->stopping.load() ||
+        std::uniform_real_distribution< double >(0, 1)(rng) >= kill_probability)
+    {
+        return;
+    }
+    int64_t expected = 0;
+    if (!shared->kill_ns.compare_exchange_strong(expected, -1)) {
+        return;
+    }
+    shared->kill_point.store(point);
+    shared->kills[point].fetch_add(1);
+    shared->kill_ns.store(lap::monotonic_ns());
+    raise(SIGKILL);
+}
+
+void note_recovery() {
+    int64_t killed_ns = shared->kill_ns.load();
+    if (killed_ns <= 0 ||
+        !shared->kill_ns.compare_exchange_strong(killed_ns, 0))
+    {
+        return;
+    }
+    int32_t point      = shared->kill_point.load();
+    int64_t recovery   = lap::monotonic_ns() - killed_ns;
+    int64_t max_so_far = shared->max_recovery_ns[point].load();
+    shared->recovery_ns[point].record(recovery);
+    while (recovery > max_so_far &&
+           !shared->max_recovery_ns[point].compare_exchange_weak(
+             max_so_far, recovery))
+    {
+    }
+}
+
+[[noreturn]] void worker(lap::SemaphoreSet &sem_set, int64_t hold_ns) {
+    rng.seed(getpid());
+    lap::set_fault_hook(maybe_die);
+    timespec hold = {hold_ns / 1000000000LL, hold_ns % 1000000000LL};
+    while (!shared->stopping.load()) {
+        sem_set.Swait({
+          {POOL, {1, -1}},
+        });
+        note_recovery();
+        shared->acquisitions.fetch_add(1);
+        nanosleep(&hold, nullptr);
+        sem_set.Ssignal(POOL);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/// @note: once every worker is gone nothing may be held, waiting or
+/// reserved any more. Returns the permits that did not come back
+int32_t check_leaks(const lap::SemaphoreSet &sem_set, int32_t capacity) {
+    const lap::ControlBlock *ctrl = sem_set.getControlBlock();
+    int32_t reserved = ctrl->sems()[POOL].reserved;
+    int32_t leaked   = capacity - (sem_set.getVal(POOL) - reserved);
+
+    int32_t waiters = 0, holders = 0;
+    for (auto &waiter : ctrl->waiters) {
+        waiters += waiter.pid.load() != 0;
+    }
+    for (auto &holder : ctrl->sems()[POOL].holders) {
+        holders += holder.pid.load() != 0;
+    }
+    int32_t park_semid = ctrl->park_semid.load();
+    int32_t tokens     = 0;
+    for (int32_t slot = 0; slot < lap::kMaxWaiters && park_semid != -1;
+         ++slot)
+    {
+        tokens += semctl(park_semid, slot, GETVAL);
+    }
+
+    std::printf("leaked permits %d (reserved for dead waiters %d)\n", leaked,
+      reserved);
+    std::printf("stale waiter slots %d, stale holder slots %d, "
+                "stale wake tokens %d\n",
+      waiters, holders, tokens);
+    return leaked;
+}
+
+} // namespace
+
+/// fork workers that take and give back permits of one semaphore and
+/// kill them at random fault points inside Swait and Ssignal
+///
+///     semset-crash [-w workers] [-c capacity] [-t seconds] [-p probability]
+///                  [-h hold_us] [-H] [-R]
+///
+/// @note: reports per fault point how long it took until some process
+/// acquired again after the death, and whether permits leaked once every
+/// worker is gone. Exits with 1 on a leak or when nobody acquired for
+/// kStallNs. -R runs a HolderReaper in the harness
+int main(int argc, char **argv) {
+    int32_t num_workers = 6, capacity = 2;
+    double seconds      = 5;
+    int64_t hold_ns     = 100000;
+    bool reap           = false;
+    lap::SemSetConfig config;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:c:t:p:h:HR")) != -1) {
+        switch (opt) {
+            case 'w':
+                num_workers = std::atoi(optarg);
+                break;
+            case 'c':
+                capacity = std::atoi(optarg);
+                break;
+            case 't':
+                seconds = std::atof(optarg);
+                break;
+            case 'p':
+                kill_probability = std::atof(optarg);
+                break;
+            case 'h':
+                hold_ns = std::atoll(optarg) * 1000;
+                break;
+            case 'H':
+                config.handoff = true;
+                break;
+            case 'R':
+                reap = true;
+                break;
+            default:
+                std::fprintf(stderr,
+                  "usage: %s [-w workers] [-c capacity] [-t seconds] "
+                  "[-p probability] [-h hold_us] [-H] [-R]\n",
+                  argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    /// @note: every kill makes some process reap a waiter slot, show
+    /// those warnings with SPDLOG_LEVEL=warn
+    spdlog::set_level(spdlog::level::err);
+    spdlog::cfg::load_env_levels();
+
+    shared = (Shared *)mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        std::perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    lap::SemaphoreSet sem_set(IPC_PRIVATE, {{POOL, capacity}}, config);
+    std::unique_ptr< lap::HolderReaper > reaper;
+    if (reap) {
+        reaper = std::make_unique< lap::HolderReaper >(sem_set);
+    }
+    auto spawn = [&] {
+        pid_t pid = fork();
+        if (pid == 0) {
+            worker(sem_set, hold_ns);
+        }
+        return pid;
+    };
+    std::vector< pid_t > workers;
+    for (int32_t i = 0; i < num_workers; ++i) {
+        workers.push_back(spawn());
+    }
+
+    /// @note: replace every killed worker, until the time is up or a
+    /// death goes unrecovered for kStallNs
+    int64_t deadline_ns = lap::monotonic_ns() + (int64_t)(seconds * 1e9);
+    int32_t stalled_at  = -1;
+    uint64_t last_acquisitions = 0;
+    int64_t progress_ns        = lap::monotonic_ns();
+    while (lap::monotonic_ns() < deadline_ns) {
+        int32_t status;
+        pid_t dead;
+        while ((dead = waitpid(-1, &status, WNOHANG)) > 0) {
+            std::replace(workers.begin(), workers.end(), dead, spawn());
+        }
+        if (shared->acquisitions.load() != last_acquisitions) {
+            last_acquisitions = shared->acquisitions.load();
+            progress_ns       = lap::monotonic_ns();
+        }
+        else if (lap::monotonic_ns() - progress_ns > kStallNs) {
+            stalled_at = shared->kill_point.load();
+            break;
+        }
+        usleep(1000);
+    }
+
+    shared->stopping.store(true);
+    int32_t stuck        = 0;
+    int64_t drain_end_ns = lap::monotonic_ns() + kDrainNs;
+    for (pid_t pid : workers) {
+        int32_t status;
+        while (waitpid(pid, &status, WNOHANG) == 0) {
+            if (lap::monotonic_ns() > drain_end_ns) {
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+                ++stuck;
+                break;
+            }
+            usleep(1000);
+        }
+    }
+
+    std::printf("%-14s %6s %12s %12s %12s\n", "fault point", "kills",
+      "recovery p50", "p99", "max");
+    uint64_t total_kills = 0;
+    for (int32_t point = 0; point < lap::kNumFaultPoints; ++point) {
+        uint64_t counts[lap::kHistBuckets];
+        shared->recovery_ns[point].load(counts);
+        total_kills += shared->kills[point].load();
+        /// @note: a bucket bound can lie above the largest sample
+        int64_t max_ns = shared->max_recovery_ns[point].load();
+        std::printf("%-14s %6lu %12s %12s %12s\n",
+          lap::fault_point_name((lap::FaultPoint)point),
+          (unsigned long)shared->kills[point].load(),
+          lap::format_ns(std::min(lap::hist_percentile(counts, 0.5), max_ns))
+            .c_str(),
+          lap::format_ns(std::min(lap::hist_percentile(counts, 0.99), max_ns))
+            .c_str(),
+          lap::format_ns(max_ns).c_str());
+    }
+    std::printf("%lu acquisitions, %lu kills, %d workers stuck at the end\n",
+      (unsigned long)shared->acquisitions.load(), (unsigned long)total_kills,
+      stuck);
+    if (reaper != nullptr) {
+        /// @note: the last deaths may still be in flight
+        usleep(50000);
+        std::printf("reaper reclaimed %lu dead processes\n",
+          (unsigned long)reaper->getReclaimed());
+    }
+    if (stalled_at != -1) {
+        std::printf("stalled: nobody acquired for %s, last kill at %s\n",
+          lap::format_ns(kStallNs).c_str(),
+          lap::fault_point_name((lap::FaultPoint)stalled_at));
+    }
+    int32_t leaked = check_leaks(sem_set, capacity);
+    return leaked == 0 && stalled_at == -1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
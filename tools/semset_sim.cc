@@ -0,0 +1,316 @@
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "fault_injection.h"
+#include "sem_clock.h"
+#include "sem_sim.h"
+
+namespace {
+
+/// the semaphores of the reader/writer problem in main.cc
+enum SemaphoreNames { READ_LEFT = 0, RW_MUTEX, WAIT };
+constexpr int32_t MAX_READERS = 3;
+
+lap::sim_program_t reader(int32_t rounds) {
+    lap::sim_program_t program;
+    for (int32_t i = 0; i < rounds; ++i) {
+        program.push_back({lap::SimAction::SWAIT,
+          {
+            {READ_LEFT, {1, -1}},
+            {WAIT,      {1, 0} },
+            {RW_MUTEX,  {1, 0} },
+        }});
+        program.push_back({lap::SimAction::ENTER_SHARED});
+        program.push_back({lap::SimAction::LEAVE_SHARED});
+        program.push_back({lap::SimAction::SSIGNAL, {}, READ_LEFT});
+    }
+    return program;
+}
+
+lap::sim_program_t writer(int32_t rounds) {
+    lap::sim_program_t program;
+    for (int32_t i = 0; i < rounds; ++i) {
+        program.push_back({lap::SimAction::SWAIT,
+          {
+            {WAIT, {1, -1}},
+        }});
+        program.push_back({lap::SimAction::SWAIT,
+          {
+            {RW_MUTEX,  {1, -1}},
+            {READ_LEFT, {3, 0} }
+        }});
+        program.push_back({lap::SimAction::ENTER_EXCLUSIVE});
+        program.push_back({lap::SimAction::LEAVE_EXCLUSIVE});
+        program.push_back({lap::SimAction::SSIGNAL, {}, WAIT});
+        program.push_back({lap::SimAction::SSIGNAL, {}, RW_MUTEX});
+    }
+    return program;
+}
+
+/// a schedule of the real set running longer than this is a hang
+constexpr int64_t kRealRunNs = 10000000000;
+
+/// the sections of the real processes, shared by all of them
+struct RealSections {
+    std::atomic< int32_t > shared;
+    std::atomic< int32_t > exclusive;
+};
+
+RealSections *sections = nullptr;
+uint64_t perturb_state = 0;
+
+/// @note: splitmix64 like the model, seeded per schedule and process
+uint64_t next_perturb() {
+    uint64_t z = (perturb_state += 0x9e3779b97f4a7c15ULL);
+    z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z          = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/// @note: widen the window at hand now and then, so the other processes
+/// run into the races the model explores
+void perturb() {
+    uint64_t roll = next_perturb() % 8;
+    if (roll == 0) {
+        timespec nap = {0, (long)(next_perturb() % 200000)};
+        nanosleep(&nap, nullptr);
+    }
+    else if (roll < 3) {
+        sched_yield();
+    }
+}
+
+void perturb_at(lap::FaultPoint point, uint16_t sem_numid) { perturb(); }
+
+[[noreturn]] void run_real_process(lap::SemaphoreSet &sem_set,
+  const lap::sim_program_t &program, int32_t max_shared, uint64_t seed,
+  int32_t pid) {
+    perturb_state = seed * 1000003 + pid;
+    lap::set_fault_hook(perturb_at);
+    for (auto &action : program) {
+        bool ok = true;
+        switch (action.kind) {
+            case lap::SimAction::SWAIT:
+                sem_set.Swait(action.request);
+                break;
+            case lap::SimAction::SSIGNAL:
+                sem_set.Ssignal(action.sem_numid, action.sem_op);
+                break;
+            case lap::SimAction::ENTER_SHARED:
+                ok = sections->shared.fetch_add(1) + 1 <= max_shared &&
+                     sections->exclusive.load() == 0;
+                perturb();
+                break;
+            case lap::SimAction::LEAVE_SHARED:
+                sections->shared.fetch_sub(1);
+                break;
+            case lap::SimAction::ENTER_EXCLUSIVE:
+                ok = sections->exclusive.fetch_add(1) == 0 &&
+                     sections->shared.load() == 0;
+                perturb();
+                break;
+            case lap::SimAction::LEAVE_EXCLUSIVE:
+                sections->exclusive.fetch_sub(1);
+                break;
+        }
+        if (!ok) {
+            std::printf("seed %lu: p%d entered a section it must not\n",
+              (unsigned long)seed, pid);
+            std::fflush(stdout);
+            _exit(EXIT_FAILURE);
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/// @note: one schedule of the programs as real processes on `sem_set`.
+/// False on a broken invariant, a hang or permits left behind
+bool run_real(lap::SemaphoreSet &sem_set, const lap::SimConfig &config,
+  uint64_t seed, bool &hung) {
+    std::vector< pid_t > procs;
+    for (size_t i = 0; i < config.programs.size(); ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_real_process(
+              sem_set, config.programs[i], config.max_shared, seed, i);
+        }
+        procs.push_back(pid);
+    }
+
+    bool ok             = true;
+    int64_t deadline_ns = lap::monotonic_ns() + kRealRunNs;
+    for (pid_t pid : procs) {
+        int32_t status = 0;
+        while (!hung && waitpid(pid, &status, WNOHANG) == 0) {
+            if (lap::monotonic_ns() > deadline_ns) {
+                hung = true;
+                break;
+            }
+            usleep(1000);
+        }
+        if (hung) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            continue;
+        }
+        ok &= WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    }
+    if (hung) {
+        std::printf("seed %lu: still running after %llds, parked for good\n",
+          (unsigned long)seed, (long long)(kRealRunNs / 1000000000));
+        return false;
+    }
+
+    for (size_t sem = 0; sem < config.initial_values.size(); ++sem) {
+        if (sem_set.getVal(sem) != config.initial_values[sem]) {
+            std::printf("seed %lu: sem %zu ends at %d instead of %d\n",
+              (unsigned long)seed, sem, sem_set.getVal(sem),
+              config.initial_values[sem]);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/// @note: the schedules of the model run on a real set instead, see
+/// run_real. Seeded but not replayable, the kernel schedules the rest
+int32_t run_real_seeds(
+  const lap::SimConfig &config, uint64_t first_seed, uint64_t num_seeds) {
+    lap::sem_name_id_map_t sems;
+    for (size_t sem = 0; sem < config.initial_values.size(); ++sem) {
+        sems[sem] = config.initial_values[sem];
+    }
+    lap::SemSetConfig set_config;
+    set_config.handoff = config.handoff;
+    lap::SemaphoreSet sem_set(IPC_PRIVATE, sems, set_config);
+    sections = (RealSections *)mmap(nullptr, sizeof(RealSections),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    uint64_t failed = 0;
+    bool hung       = false;
+    auto begin      = std::chrono::steady_clock::now();
+    uint64_t seed   = first_seed;
+    for (; seed < first_seed + num_seeds && !hung; ++seed) {
+        failed += !run_real(sem_set, config, seed, hung);
+    }
+    double secs = std::chrono::duration< double >(
+      std::chrono::steady_clock::now() - begin)
+                    .count();
+
+    std::printf("%lu real schedules, %lu failed, %.0f schedules/s\n",
+      (unsigned long)(seed - first_seed), (unsigned long)failed,
+      (seed - first_seed) / secs);
+    munmap(sections, sizeof(RealSections));
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // namespace
+
+/// explore schedules of the reader/writer problem of main.cc
+///
+///     semset-sim [-r readers] [-w writers] [-n rounds] [-H] [-R]
+///                [-s first_seed] [-c seeds] [-v seed]
+///
+/// @note: -H models hand-off mode, -v replays one seed step by step. -R
+/// runs the programs on a real set in forked processes, 1000 seeds unless
+/// -c says otherwise
+int main(int argc, char **argv) {
+    int32_t readers = 3, writers = 5, rounds = 1;
+    uint64_t first_seed = 1, num_seeds = 100000;
+    int64_t replay_seed = -1;
+    bool handoff = false, real = false, seeds_given = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:n:HRs:c:v:")) != -1) {
+        switch (opt) {
+            case 'r':
+                readers = std::atoi(optarg);
+                break;
+            case 'w':
+                writers = std::atoi(optarg);
+                break;
+            case 'n':
+                rounds = std::atoi(optarg);
+                break;
+            case 'H':
+                handoff = true;
+                break;
+            case 'R':
+                real = true;
+                break;
+            case 's':
+                first_seed = std::strtoull(optarg, nullptr, 0);
+                break;
+            case 'c':
+                num_seeds   = std::strtoull(optarg, nullptr, 0);
+                seeds_given = true;
+                break;
+            case 'v':
+                replay_seed = std::strtoll(optarg, nullptr, 0);
+                break;
+            default:
+                std::fprintf(stderr,
+                  "usage: %s [-r readers] [-w writers] [-n rounds] [-H] "
+                  "[-R] [-s first_seed] [-c seeds] [-v seed]\n",
+                  argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    lap::SimConfig config;
+    config.handoff        = handoff;
+    config.initial_values = {MAX_READERS, 1, 1};
+    config.max_shared     = MAX_READERS;
+    for (int32_t i = 0; i < readers; ++i) {
+        config.programs.push_back(reader(rounds));
+    }
+    for (int32_t i = 0; i < writers; ++i) {
+        config.programs.push_back(writer(rounds));
+    }
+
+    if (real) {
+        return run_real_seeds(
+          config, first_seed, seeds_given ? num_seeds : 1000);
+    }
+
+    if (replay_seed >= 0) {
+        config.record_trace = true;
+        lap::SimSemaphoreSet sim(config);
+        const lap::SimResult &result = sim.run(replay_seed);
+        for (auto &line : result.trace) {
+            std::printf("%s\n", line.c_str());
+        }
+        std::printf("%s\n", result.ok ? "ok" : result.failure.c_str());
+        return result.ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    lap::SimSemaphoreSet sim(config);
+    uint64_t failed = 0, steps = 0;
+    auto begin      = std::chrono::steady_clock::now();
+    for (uint64_t seed = first_seed; seed < first_seed + num_seeds; ++seed) {
+        const lap::SimResult &result = sim.run(seed);
+        steps += result.steps;
+        if (!result.ok && failed++ < 10) {
+            std::printf("seed %lu: %s\n", (unsigned long)seed,
+              result.failure.c_str());
+        }
+    }
+    double secs = std::chrono::duration< double >(
+      std::chrono::steady_clock::now() - begin)
+                    .count();
+
+    std::printf("%lu schedules, %lu failed, %.0f schedules/s, %.0f steps/s\n",
+      (unsigned long)num_seeds, (unsigned long)failed, num_seeds / secs,
+      steps / secs);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
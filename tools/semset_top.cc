@@ -0,0 +1,185 @@
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "sem_clock.h"
+#include "sem_control_block.h"
+#include "sem_shards.h"
+
+namespace {
+
+struct Snapshot {
+    std::vector< uint64_t > acquisitions;
+    std::vector< std::vector< uint64_t > > wait_hist;
+    std::vector< std::vector< uint64_t > > hold_hist;
+};
+
+Snapshot take_snapshot(lap::ControlBlock *ctrl) {
+    Snapshot snap;
+    for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+        lap::SemStats &stats = ctrl->sems()[i].stats;
+        snap.acquisitions.push_back(stats.acquisitions.load());
+        uint64_t counts[lap::kHistBuckets];
+        stats.wait_ns.load(counts);
+        snap.wait_hist.emplace_back(counts, counts + lap::kHistBuckets);
+        stats.hold_ns.load(counts);
+        snap.hold_hist.emplace_back(counts, counts + lap::kHistBuckets);
+    }
+    return snap;
+}
+
+void print_frame(lap::ControlBlock *ctrl, const Snapshot &prev,
+  const Snapshot &cur, double interval_s) {
+    std::vector< unsigned short > vals(ctrl->num_sems);
+    if (!lap::get_all_values(ctrl, vals.data())) {
+        spdlog::error("Error reading values of set {}: {}", ctrl->semids[0],
+          std::strerror(errno));
+        exit(1);
+    }
+
+    std::printf("\033[H\033[2J");
+    std::printf("semid %d  %d semaphores in %d kernel sets, park set %s, "
+                "created in %s\n\n",
+      ctrl->semids[0], ctrl->num_sems, ctrl->num_shards,
+      ctrl->park_semid.load() == -1 ? "none" : "made",
+      lap::format_ns(ctrl->create_ns).c_str());
+    std::printf("%5s %-16s %6s %6s %7s %9s %9s %9s %9s  %-20s %s\n", "sem",
+      "name", "value", "cap", "waiters", "acq/s", "wait p50", "wait p99",
+      "hold p99", "holders", "blocked");
+
+    for (int32_t i = 0; i < ctrl->num_sems; ++i) {
+        lap::SemSlot &slot = ctrl->sems()[i];
+
+        std::string holders;
+        for (auto &holder : slot.holders) {
+            pid_t pid = holder.pid.load();
+            if (pid != 0) {
+                holders += std::to_string(pid) + "x" +
+                           std::to_string(holder.count.load()) + "@" +
+                           ctrl->site_name(holder.site.load()) + " ";
+            }
+        }
+
+        std::string blocked;
+        int32_t waiters = 0;
+        for (auto &waiter : ctrl->waiters) {
+            pid_t pid = waiter.pid.load();
+            if (pid != 0 && waiter.blocked_on == i) {
+                ++waiters;
+                blocked += std::to_string(pid) + " ";
+            }
+        }
+
+        /// @note: percentiles of the waits and holds finished since the
+        /// last frame
+        uint64_t delta[lap::kHistBuckets];
+        uint64_t hold_delta[lap::kHistBuckets];
+        for (int32_t b = 0; b < lap::kHistBuckets; ++b) {
+            delta[b]      = cur.wait_hist[i][b] - prev.wait_hist[i][b];
+            hold_delta[b] = cur.hold_hist[i][b] - prev.hold_hist[i][b];
+        }
+        double rate =
+          (cur.acquisitions[i] - prev.acquisitions[i]) / interval_s;
+
+        std::printf("%5u %-16s %6u %6d %7d %9.1f %9s %9s %9s  %-20s %s\n",
+          slot.name, slot.label, vals[i], slot.capacity.load(), waiters, rate,
+          lap::format_ns(lap::hist_percentile(delta, 0.5)).c_str(),
+          lap::format_ns(lap::hist_percentile(delta, 0.99)).c_str(),
+          lap::format_ns(lap::hist_percentile(hold_delta, 0.99)).c_str(),
+          holders.c_str(), blocked.c_str());
+    }
+    std::fflush(stdout);
+}
+
+} // namespace
+
+/// live view of a SemaphoreSet created with a key or a state file
+///
+///     semset-top <key | state_path> [-i interval_ms] [-n iterations]
+///
+/// @note: attaches read-only to the control block segment and never
+/// takes a lock, the only syscall per refresh is one GETALL. An argument
+/// with a '/' in it is taken as the state_path of the set
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr,
+          "usage: %s <key | state_path> [-i interval_ms] [-n iterations]\n",
+          argv[0]);
+        return EXIT_FAILURE;
+    }
+    key_t key           = (key_t)std::strtol(argv[1], nullptr, 0);
+    bool is_file        = std::strchr(argv[1], '/') != nullptr;
+    int32_t interval_ms = 1000;
+    int32_t iterations  = -1;
+
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval_ms = std::atoi(optarg);
+                break;
+            case 'n':
+                iterations = std::atoi(optarg);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    void *addr = (void *)-1;
+    if (is_file) {
+        int32_t fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0 &&
+            st.st_size >= (off_t)sizeof(lap::ControlBlock))
+        {
+            addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    else {
+        int32_t shmid = shmget(key, 0, 0);
+        addr = shmid == -1 ? (void *)-1 : shmat(shmid, nullptr, SHM_RDONLY);
+    }
+    if (addr == (void *)-1) {
+        spdlog::error("No SemaphoreSet control block in {}: {}", argv[1],
+          std::strerror(errno));
+        return EXIT_FAILURE;
+    }
+    auto *ctrl = (lap::ControlBlock *)addr;
+    if (ctrl->magic != lap::ControlBlock::kMagic) {
+        spdlog::error("{} is not a SemaphoreSet", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Snapshot prev = take_snapshot(ctrl);
+    while (iterations != 0) {
+        usleep(interval_ms * 1000);
+        Snapshot cur = take_snapshot(ctrl);
+        print_frame(ctrl, prev, cur, interval_ms / 1000.0);
+        prev = std::move(cur);
+        if (iterations > 0) {
+            --iterations;
+        }
+    }
+
+    if (!is_file) {
+        shmdt(addr);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#include <spdlog/spdlog.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include "sem_trace.h"
+
+/// decode a trace ring dumped by SemaphoreSet::dump_trace
+///
+///     semset-trace <dump>                    print every event
+///     semset-trace <dump> --chrome out.json  Chrome/Perfetto trace
+int main(int argc, char **argv) {
+    bool chrome = argc == 4 && std::strcmp(argv[2], "--chrome") == 0;
+    if (argc != 2 && !chrome) {
+        std::fprintf(
+          stderr, "usage: %s <trace dump> [--chrome out.json]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    auto records = lap::read_trace_file(argv[1]);
+    if (records.empty()) {
+        return EXIT_FAILURE;
+    }
+
+    if (chrome) {
+        std::ofstream os(argv[3]);
+        if (!os) {
+            spdlog::error("Error opening {}", argv[3]);
+            return EXIT_FAILURE;
+        }
+        lap::export_chrome_trace(records, os);
+        return EXIT_SUCCESS;
+    }
+
+    int64_t start_ns = records.front().ts_ns;
+    std::printf("%14s %8s %6s %-8s %6s %s\n", "time(us)", "pid", "sem", "op",
+      "value", "outcome");
+    for (const auto &rd : records) {
+        const char *outcome = "";
+        if (rd.op == lap::TRACE_ACQUIRE) {
+            outcome = rd.outcome == lap::TRACE_WOKEN ? "woken" : "fast";
+        }
+        std::printf("%14.3f %8d %6u %-8s %6d %s\n",
+          (rd.ts_ns - start_ns) / 1000.0, rd.pid, rd.sem_numid,
+          lap::trace_op_name(rd.op), rd.value, outcome);
+    }
+    return EXIT_SUCCESS;
+}